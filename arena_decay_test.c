@@ -0,0 +1,118 @@
+// Copyright 2022 by [Chris Palmer](https://noncombatant.org)
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#include "arena_malloc.h"
+#include "get_utc_nanoseconds.h"
+
+static const char HelpMessage[] =
+    "Checks that `ArenaOptions.decay_milliseconds` releases idle memory, and\n"
+    "only idle memory. `block_count` blocks of up to `block_size` bytes are\n"
+    "allocated and freed over and over for 4 periods, and then freed and left\n"
+    "idle for 4 more while the arena serves small allocations. The arena\n"
+    "should keep its chunks while the blocks are in use, and release most of\n"
+    "them once they are idle.\n"
+    "\n"
+    "Usage: arena_decay_test decay_milliseconds block_count block_size\n";
+
+static uint64_t random_state = 1;
+
+// xorshift64, so that every platform sees the same sizes.
+static uint64_t get_random(void) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return random_state;
+}
+
+static noreturn void help() {
+  fprintf(stderr, HelpMessage);
+  exit(1);
+}
+
+static void* check(void* p) {
+  if (p == NULL) {
+    printf("%s\n", strerror(errno));
+    exit(errno);
+  }
+  return p;
+}
+
+// Returns how many times `a` has gotten a new `Chunk`. Sets `*chunk_bytes` to
+// the total size of the ones it has now.
+static size_t get_chunk_gets(const Arena* a, size_t* chunk_bytes) {
+  ArenaStats stats;
+  arena_get_stats(a, &stats);
+  *chunk_bytes = stats.chunk_bytes;
+  return stats.chunk_map_count + stats.chunk_reuse_count;
+}
+
+int main(int count, char* arguments[]) {
+  if (count != 4) {
+    help();
+  }
+  const unsigned decay_milliseconds =
+      (unsigned)strtoul(arguments[1], NULL, 0);
+  const size_t block_count = strtoul(arguments[2], NULL, 0);
+  const size_t block_size = strtoul(arguments[3], NULL, 0);
+  if (decay_milliseconds == 0 || block_count == 0 || block_size == 0) {
+    help();
+  }
+
+  char** blocks = check(calloc(block_count, sizeof(char*)));
+  size_t* sizes = check(calloc(block_count, sizeof(size_t)));
+  for (size_t i = 0; i < block_count; i++) {
+    sizes[i] = 1 + get_random() % block_size;
+  }
+  Arena a;
+  arena_create_with_options(
+      &a, &(ArenaOptions){.decay_milliseconds = decay_milliseconds});
+  const int64_t period = (int64_t)decay_milliseconds * 1000000;
+
+  // In use: every block is reallocated well within a period of being freed,
+  // so after the 1st round, the arena should never need another chunk.
+  size_t churned_bytes = 0;
+  size_t first_gets = 0;
+  const int64_t churn_end = GetMonotonicNanoseconds() + 4 * period;
+  while (GetMonotonicNanoseconds() < churn_end) {
+    for (size_t i = 0; i < block_count; i++) {
+      blocks[i] = check(arena_malloc(&a, 1, sizes[i]));
+      memset(blocks[i], 1, sizes[i]);
+    }
+    const size_t gets = get_chunk_gets(&a, &churned_bytes);
+    if (first_gets == 0) {
+      first_gets = gets;
+    } else if (gets != first_gets) {
+      printf("released and got back %zu chunks in use\n", gets - first_gets);
+      return 1;
+    }
+    for (size_t i = 0; i < block_count; i++) {
+      arena_free(&a, blocks[i]);
+    }
+  }
+
+  // Idle: only small allocations, which must not keep the blocks’ memory.
+  const int64_t idle_end = GetMonotonicNanoseconds() + 4 * period;
+  while (GetMonotonicNanoseconds() < idle_end) {
+    arena_free(&a, check(arena_malloc(&a, 1, 16)));
+  }
+  size_t idle_bytes;
+  get_chunk_gets(&a, &idle_bytes);
+
+  printf("%u ms: chunk KiB in use: %zu, idle: %zu\n", decay_milliseconds,
+         churned_bytes / 1024, idle_bytes / 1024);
+  if (idle_bytes > churned_bytes / 2) {
+    printf("kept too much idle memory\n");
+    return 1;
+  }
+
+  arena_destroy(&a);
+  free(sizes);
+  free(blocks);
+}
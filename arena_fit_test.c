@@ -0,0 +1,143 @@
+// Copyright 2022 by [Chris Palmer](https://noncombatant.org)
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "arena_malloc.h"
+#include "get_utc_nanoseconds.h"
+
+static const char HelpMessage[] =
+    "Compares fit policies (`ArenaOptions.fit_policy`) on a randomized\n"
+    "trace. The trace keeps `live_count` slots; each operation picks a\n"
+    "random slot, frees its region (if any), and allocates a new one of a\n"
+    "random size: mostly small, sometimes medium, and occasionally large.\n"
+    "Every page of each region is touched, so the peak resident set size\n"
+    "shows how much memory the arena needed for the peak live bytes.\n"
+    "\n"
+    "`policy` is \"next\" or \"best\". Run each policy in its own process,\n"
+    "since the peak RSS is per process.\n"
+    "\n"
+    "Usage: arena_fit_test policy operations live_count seed\n";
+
+typedef struct Slot {
+  char* p;
+  size_t byte_count;
+} Slot;
+
+static uint64_t random_state;
+
+// xorshift64, so that every platform sees the same trace for a given seed.
+static uint64_t get_random(void) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return random_state;
+}
+
+static size_t get_random_size(void) {
+  const uint64_t r = get_random() % 100;
+  if (r < 80) {
+    return 16 + get_random() % 240;
+  }
+  if (r < 95) {
+    return 256 + get_random() % 7936;
+  }
+  return 8192 + get_random() % 253952;
+}
+
+static void touch_pages(char* p, size_t byte_count) {
+  for (size_t i = 0; i < byte_count; i += 4096) {
+    p[i] = 1;
+  }
+  p[byte_count - 1] = 1;
+}
+
+static size_t get_peak_rss(void) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage)) {
+    return 0;
+  }
+#if defined(__APPLE__)
+  return (size_t)usage.ru_maxrss;
+#else
+  return (size_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+static noreturn void help() {
+  fprintf(stderr, HelpMessage);
+  exit(1);
+}
+
+int main(int count, char* arguments[]) {
+  if (count != 5) {
+    help();
+  }
+  ArenaOptions options = {0};
+  if (strcmp(arguments[1], "next") == 0) {
+    options.fit_policy = arena_fit_next;
+  } else if (strcmp(arguments[1], "best") == 0) {
+    options.fit_policy = arena_fit_best;
+  } else {
+    help();
+  }
+  const size_t operations = strtoul(arguments[2], NULL, 0);
+  const size_t live_count = strtoul(arguments[3], NULL, 0);
+  random_state = strtoull(arguments[4], NULL, 0) | 1;
+  if (operations == 0 || live_count == 0) {
+    help();
+  }
+
+  Slot* slots = calloc(live_count, sizeof(Slot));
+  if (slots == NULL) {
+    printf("%s\n", strerror(errno));
+    return errno;
+  }
+  const size_t baseline_rss = get_peak_rss();
+
+  Arena a;
+  arena_create_with_options(&a, &options);
+  size_t live_bytes = 0, peak_live_bytes = 0;
+  const int64_t start = GetUTCNanoseconds();
+
+  for (size_t i = 0; i < operations; i++) {
+    Slot* s = &slots[get_random() % live_count];
+    if (s->p != NULL) {
+      arena_free(&a, s->p);
+      live_bytes -= s->byte_count;
+    }
+    s->byte_count = get_random_size();
+    s->p = arena_malloc(&a, s->byte_count, 1);
+    if (s->p == NULL) {
+      printf("%s\n", strerror(errno));
+      return errno;
+    }
+    touch_pages(s->p, s->byte_count);
+    live_bytes += s->byte_count;
+    if (live_bytes > peak_live_bytes) {
+      peak_live_bytes = live_bytes;
+    }
+  }
+
+  const int64_t end = GetUTCNanoseconds();
+  const size_t peak_rss = get_peak_rss() - baseline_rss;
+  printf("%s fit: ns per operation: %" PRId64
+         ", peak live: %zu KiB, peak RSS: %zu KiB (%.2fx)\n",
+         arguments[1], (end - start) / (int64_t)operations,
+         peak_live_bytes / 1024, peak_rss / 1024,
+         (double)peak_rss / (double)peak_live_bytes);
+
+  for (size_t i = 0; i < live_count; i++) {
+    if (slots[i].p != NULL) {
+      arena_free(&a, slots[i].p);
+    }
+  }
+  arena_destroy(&a);
+  free(slots);
+}
@@ -0,0 +1,160 @@
+// Copyright 2022 by [Chris Palmer](https://noncombatant.org)
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "arena_malloc.h"
+#include "get_utc_nanoseconds.h"
+
+static const char HelpMessage[] =
+    "Measures the cost of short-lived arenas. It creates an arena, makes\n"
+    "`allocation_count` allocations of `allocation_size` bytes in it\n"
+    "(writing to each), and destroys it, `arena_count` times.\n"
+    "\n"
+    "`source` says where the arenas' chunks come from:\n"
+    "\n"
+    "  platform  `mmap`, every time (the chunk cache is emptied after each\n"
+    "            arena)\n"
+    "  cache     the chunk cache that `arena_destroy` fills\n"
+    "  parent    1 long-lived parent arena (`ArenaOptions.parent`)\n"
+    "  reset     the parent, which is reset while each arena is alive (and\n"
+    "            destroys it), and finally destroyed while 1 is alive\n"
+    "\n"
+    "Usage: arena_lifetime_test source arena_count allocation_count "
+    "allocation_size\n";
+
+typedef enum Source {
+  source_platform,
+  source_cache,
+  source_parent,
+  source_reset,
+} Source;
+
+static long get_minor_faults(void) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage)) {
+    return 0;
+  }
+  return usage.ru_minflt;
+}
+
+static noreturn void fail(const char* message) {
+  printf("%s\n", message);
+  exit(1);
+}
+
+static noreturn void help() {
+  fprintf(stderr, HelpMessage);
+  exit(1);
+}
+
+int main(int count, char* arguments[]) {
+  if (count != 5) {
+    help();
+  }
+  Source source;
+  if (strcmp(arguments[1], "platform") == 0) {
+    source = source_platform;
+  } else if (strcmp(arguments[1], "cache") == 0) {
+    source = source_cache;
+  } else if (strcmp(arguments[1], "parent") == 0) {
+    source = source_parent;
+  } else if (strcmp(arguments[1], "reset") == 0) {
+    source = source_reset;
+  } else {
+    help();
+  }
+  const size_t arena_count = strtoul(arguments[2], NULL, 0);
+  const size_t allocation_count = strtoul(arguments[3], NULL, 0);
+  const size_t allocation_size = strtoul(arguments[4], NULL, 0);
+  if (arena_count == 0 || allocation_count == 0 || allocation_size == 0) {
+    help();
+  }
+
+  Arena parent;
+  arena_create_with_options(&parent, &(ArenaOptions){0});
+  // Small chunks, so that many fit in each of the parent’s.
+  const ArenaOptions options = {
+      .minimum_chunk_units = ((size_t)1 << 16) / 16,
+      .parent = source >= source_parent ? &parent : NULL,
+  };
+
+  size_t chunk_map_count = 0, chunk_reuse_count = 0;
+  const long start_faults = get_minor_faults();
+  const int64_t start = GetMonotonicNanoseconds();
+  for (size_t i = 0; i < arena_count; i++) {
+    Arena a;
+    arena_create_with_options(&a, &options);
+    for (size_t j = 0; j < allocation_count; j++) {
+      char* p = arena_malloc(&a, 1, allocation_size);
+      if (p == NULL) {
+        printf("%s\n", strerror(errno));
+        return errno;
+      }
+      memset(p, 1, allocation_size);
+    }
+    ArenaStats stats;
+    arena_get_stats(&a, &stats);
+    chunk_map_count += stats.chunk_map_count;
+    chunk_reuse_count += stats.chunk_reuse_count;
+    if (source == source_reset) {
+      ArenaMark mark;
+      if (arena_mark(&parent, &mark) || errno != EBUSY) {
+        fail("marked a parent with a child");
+      }
+      arena_reset(&parent);
+      arena_get_stats(&a, &stats);
+      if (stats.chunk_count != 0) {
+        fail("resetting the parent did not destroy the child");
+      }
+      arena_get_stats(&parent, &stats);
+      if (stats.in_use_bytes != 0) {
+        fail("resetting the parent left memory in use");
+      }
+    } else {
+      arena_destroy(&a);
+    }
+    if (source == source_platform) {
+      arena_release_cached_chunks();
+    }
+  }
+  const int64_t end = GetMonotonicNanoseconds();
+  const long faults = get_minor_faults() - start_faults;
+
+  printf("%s: ns per arena: %" PRId64
+         ", chunks mapped: %zu, reused: %zu, page faults per arena: %.1f\n",
+         arguments[1], (end - start) / (int64_t)arena_count, chunk_map_count,
+         chunk_reuse_count, (double)faults / (double)arena_count);
+
+  if (source == source_reset) {
+    // The parent destroys the child (in the same way) when it is destroyed,
+    // and the child can use the parent again afterward.
+    Arena a;
+    arena_create_with_options(&a, &options);
+    char* p = arena_malloc(&a, 1, allocation_size);
+    if (p == NULL) {
+      printf("%s\n", strerror(errno));
+      return errno;
+    }
+    arena_destroy(&parent);
+    ArenaStats stats;
+    arena_get_stats(&a, &stats);
+    if (stats.chunk_count != 0) {
+      fail("destroying the parent did not destroy the child");
+    }
+    p = arena_malloc(&a, 1, allocation_size);
+    if (p == NULL) {
+      printf("%s\n", strerror(errno));
+      return errno;
+    }
+    memset(p, 1, allocation_size);
+    arena_destroy(&a);
+  }
+  arena_destroy(&parent);
+}
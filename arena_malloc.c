@@ -2,9 +2,19 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include <sys/mman.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#endif
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -12,58 +22,312 @@
 #include <unistd.h>
 
 #include "arena_malloc.h"
+#include "get_utc_nanoseconds.h"
 
 #define add(a, b, result) __builtin_add_overflow(a, b, result)
 #define mul(a, b, result) __builtin_mul_overflow(a, b, result)
 
-// Set this to true to run `check_free` in `arena_free`. `check_free`’s
-// algorithm is very slow, making it unsuitable for production.
+// Set this to true to run `check_free` in `arena_free`. `check_free` takes
+// constant time, but it needs the arena’s lock, so this also turns off the
+// thread caches and remote frees, which are how `arena_free` avoids the lock.
 static const bool do_check_free = false;
 
-// Set this to true to `memset` regions with `overwrite_on_free_value` before
-// freeing them. The cost of the `memset` will come to dominate the time taken
-// to free as the allocation size grows, so this may be unsuitable for
-// production.
+// Set this to true to overwrite regions with 0 before freeing them. The cost of
+// writing will come to dominate the time taken to free as the allocation size
+// grows, so this may be unsuitable for production. (But see `zero_region`.) As
+// a bonus, we know that overwritten regions are zeroed, so `arena_calloc` does
+// not have to zero them again.
 static const bool overwrite_on_free = false;
-static const char overwrite_on_free_value = 0x0c;
+
+// `zero_region` zeroes regions at least this large by asking the platform for
+// fresh pages, rather than by writing to every byte. Below this size, the page
+// faults that happen when the caller touches the pages again cost more than
+// `memset` would.
+static const size_t madvise_zero_threshold = (size_t)1 << 18;
+
+// Arenas with `ArenaOptions.decay_milliseconds` check the clock once every
+// this many calls that take the lock to allocate or free.
+static const unsigned decay_check_interval = 256;
 
 // For more information about locks and tuning them, see
-// https://rigtorp.se/spinlock/. Here, we optimize for simple implementation.
+// https://rigtorp.se/spinlock/ and “Futexes Are Tricky” by Ulrich Drepper.
 
-static void lock(atomic_flag* f) {
-  do {
-  } while (atomic_flag_test_and_set_explicit(f, memory_order_acquire));
+// How many times a waiter polls a lock before going to sleep. This should be
+// long enough to cover a typical critical section (a few hundred nanoseconds),
+// but no longer.
+static const unsigned lock_spin_limit = 128;
+
+static void pause_cpu(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+// Sleeps until `*word` might no longer be `value`. Spurious wake-ups are
+// possible, so callers must re-check their condition. Preserves `errno`.
+static void wait_on(atomic_uint* word, unsigned value) {
+#if defined(__linux__)
+  const int e = errno;
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+  errno = e;
+#else
+  (void)word;
+  (void)value;
+  sched_yield();
+#endif
+}
+
+// Wakes up to `count` threads sleeping in `wait_on(word, ...)`.
+static void wake(atomic_uint* word, int count) {
+#if defined(__linux__)
+  const int e = errno;
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+  errno = e;
+#else
+  (void)word;
+  (void)count;
+#endif
+}
+
+static void lock_create(Lock* l, ArenaLockKind kind) {
+  l->kind = kind;
+  atomic_flag_clear(&(l->flag));
+  atomic_init(&(l->state), 0);
+  atomic_init(&(l->next_ticket), 0);
+  atomic_init(&(l->now_serving), 0);
+  atomic_init(&(l->waiters), 0);
+  for (size_t i = 0; i < lock_wait_slot_count; i++) {
+    atomic_init(&(l->wait_slots[i]), 0);
+  }
+  atomic_init(&(l->contention_count), 0);
+  atomic_init(&(l->spin_count), 0);
+}
+
+// Counts a wait for `l`, during which the waiter polled it `spins` times.
+static void count_wait(Lock* l, size_t spins) {
+  atomic_fetch_add_explicit(&(l->contention_count), 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&(l->spin_count), spins, memory_order_relaxed);
+}
+
+// This is “mutex 3” from Drepper’s paper.
+static void lock_mutex(Lock* l) {
+  unsigned c = 0;
+  if (atomic_compare_exchange_strong_explicit(&(l->state), &c, 1,
+                                              memory_order_acquire,
+                                              memory_order_relaxed)) {
+    return;
+  }
+  for (unsigned spins = 0; spins < lock_spin_limit; spins++) {
+    pause_cpu();
+    c = 0;
+    if (atomic_load_explicit(&(l->state), memory_order_relaxed) == 0 &&
+        atomic_compare_exchange_weak_explicit(&(l->state), &c, 1,
+                                              memory_order_acquire,
+                                              memory_order_relaxed)) {
+      count_wait(l, spins + 1);
+      return;
+    }
+  }
+  count_wait(l, lock_spin_limit);
+  // From here on, we don’t know whether there are other sleepers, so we must
+  // leave the state at 2 when we get the lock.
+  while (atomic_exchange_explicit(&(l->state), 2, memory_order_acquire) != 0) {
+    wait_on(&(l->state), 2);
+  }
+}
+
+static void unlock_mutex(Lock* l) {
+  if (atomic_fetch_sub_explicit(&(l->state), 1, memory_order_release) != 1) {
+    atomic_store_explicit(&(l->state), 0, memory_order_release);
+    wake(&(l->state), 1);
+  }
+}
+
+static void lock_ticket(Lock* l) {
+  const unsigned ticket =
+      atomic_fetch_add_explicit(&(l->next_ticket), 1, memory_order_relaxed);
+  atomic_uint* slot = &(l->wait_slots[ticket % lock_wait_slot_count]);
+  for (unsigned spins = 0; true; spins++) {
+    // Read the slot before `now_serving`. If `unlock` serves us after this, it
+    // will also change the slot, and `wait_on` will not sleep.
+    const unsigned generation = atomic_load(slot);
+    if (atomic_load(&(l->now_serving)) == ticket) {
+      if (spins != 0) {
+        count_wait(l, spins);
+      }
+      return;
+    }
+    if (spins < lock_spin_limit) {
+      pause_cpu();
+      continue;
+    }
+    // This increment and the load of `waiters` in `unlock_ticket` are
+    // sequentially consistent, so either `unlock_ticket` sees us as a waiter,
+    // or we see the change it made to `slot`.
+    atomic_fetch_add(&(l->waiters), 1);
+    wait_on(slot, generation);
+    atomic_fetch_sub(&(l->waiters), 1);
+  }
+}
+
+static void unlock_ticket(Lock* l) {
+  const unsigned next = atomic_fetch_add(&(l->now_serving), 1) + 1;
+  atomic_uint* slot = &(l->wait_slots[next % lock_wait_slot_count]);
+  atomic_fetch_add(slot, 1);
+  if (atomic_load(&(l->waiters)) != 0) {
+    // Usually only the next ticket holder is asleep on `slot`, but if there
+    // are more waiters than slots, others may share it.
+    wake(slot, INT32_MAX);
+  }
+}
+
+static void lock(Lock* l) {
+  switch (l->kind) {
+    case arena_lock_mutex:
+      lock_mutex(l);
+      return;
+    case arena_lock_ticket:
+      lock_ticket(l);
+      return;
+    case arena_lock_spin: {
+      size_t spins = 0;
+      while (
+          atomic_flag_test_and_set_explicit(&(l->flag), memory_order_acquire)) {
+        spins++;
+      }
+      if (spins != 0) {
+        count_wait(l, spins);
+      }
+      return;
+    }
+  }
 }
 
-static void unlock(atomic_flag* f) {
-  atomic_flag_clear_explicit(f, memory_order_release);
+static void unlock(Lock* l) {
+  switch (l->kind) {
+    case arena_lock_mutex:
+      unlock_mutex(l);
+      return;
+    case arena_lock_ticket:
+      unlock_ticket(l);
+      return;
+    case arena_lock_spin:
+      atomic_flag_clear_explicit(&(l->flag), memory_order_release);
+      return;
+  }
 }
 
 const size_t default_minimum_chunk_units = ((size_t)1 << 21) / sizeof(Header);
+const size_t default_mapped_threshold = (size_t)1 << 21;
+const size_t default_sample_bytes = (size_t)1 << 19;
 static size_t page_size = 0;
 
-static void arena_create_internal(Arena* a, size_t minimum_chunk_units) {
-  atomic_flag_clear(&(a->lock));
+// The size of the huge pages that `ArenaOptions.huge_pages` asks for: the
+// smallest huge page size on x86-64, and on ARM64 with 4 KiB pages.
+static const size_t huge_page_size = (size_t)1 << 21;
+
+// The `mmap` flag that faults a mapping’s pages in up front, for
+// `arena_reserve_populate`, or 0 if the platform has none.
+#if defined(MAP_POPULATE)
+static const int map_populate = MAP_POPULATE;
+#else
+static const int map_populate = 0;
+#endif
+
+// Adds `n` to the counter `c`. Only the holder of the arena’s lock changes the
+// counters, so a plain load and store suffice, and cost much less than an
+// atomic read-modify-write. The counters are atomic only so that
+// `arena_get_stats` can read them at any time.
+static void stats_add(atomic_size_t* c, size_t n) {
+  atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                        memory_order_relaxed);
+}
+
+static void stats_subtract(atomic_size_t* c, size_t n) {
+  atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) - n,
+                        memory_order_relaxed);
+}
+
+static void arena_create_internal(Arena* a, size_t minimum_chunk_units,
+                                  const ArenaOptions* options) {
+  lock_create(&(a->lock), options->lock_kind);
   a->chunk_list = NULL;
-  a->free_list.next = NULL;
-  a->free_list.unit_count = 0;
+  a->chunk_slabs = NULL;
+  a->free_chunks = NULL;
+  a->fit_policy = options->fit_policy;
   a->free_list_start = NULL;
+  a->free_tree = NULL;
+  memset(a->bins, 0, sizeof(a->bins));
+  a->bin_map = 0;
+  a->use_thread_cache = options->thread_cache && !options->region;
+  a->in_set = false;
+  a->use_remote_frees = options->remote_frees && !options->region;
+  a->owner = pthread_self();
+  atomic_init(&(a->remote_frees), NULL);
+  a->thread_caches = NULL;
+  a->decay_nanoseconds = (int64_t)options->decay_milliseconds * 1000000;
+  a->next_decay = 0;
+  a->decay_epoch = 0;
+  a->calls_since_decay_check = 0;
+  a->mappings = NULL;
+  const size_t mapped_threshold = options->mapped_threshold != 0
+                                      ? options->mapped_threshold
+                                      : default_mapped_threshold;
+  a->mapped_units = mapped_threshold / sizeof(Header) + 1;
+  a->next_mapping_serial = 0;
+  a->region = options->region;
+  a->current_chunk = NULL;
+  a->region_next = a->region_end = a->region_clean = NULL;
+  a->mark_depth = 0;
+  a->scoped_chunks = NULL;
+  a->scoped_units = 0;
+  a->mark_chunk = NULL;
+  a->mark_next = NULL;
   a->minimum_chunk_units = minimum_chunk_units;
+  a->reserved_bytes = 0;
+  a->use_huge_pages = options->huge_pages && options->parent == NULL;
+  a->parent = options->parent != NULL && !options->parent->region
+                  ? options->parent
+                  : NULL;
+  a->children = NULL;
+  a->next_sibling = a->previous_sibling = NULL;
+  a->is_child = false;
+  a->sample_bytes = options->sample_bytes;
+  a->samples = NULL;
+  a->free_samples = NULL;
+  a->sample_slabs = NULL;
+  a->next_sample_serial = 0;
+  memset(&(a->stats), 0, sizeof(a->stats));
 }
 
-void arena_create(Arena* a, size_t minimum_chunk_units) {
+void arena_create_with_options(Arena* a, const ArenaOptions* options) {
   if (page_size == 0) {
     page_size = (size_t)sysconf(_SC_PAGESIZE);
   }
+  size_t minimum_chunk_units = options->minimum_chunk_units != 0
+                                   ? options->minimum_chunk_units
+                                   : default_minimum_chunk_units;
   const size_t m = page_size / sizeof(Header);
   minimum_chunk_units = minimum_chunk_units >= m ? minimum_chunk_units : m;
-  arena_create_internal(a, minimum_chunk_units);
+  arena_create_internal(a, minimum_chunk_units, options);
+}
+
+void arena_create(Arena* a, size_t minimum_chunk_units) {
+  // Unlike `ArenaOptions.minimum_chunk_units`, 0 here means as small as
+  // possible.
+  const ArenaOptions options = {.minimum_chunk_units =
+                                     minimum_chunk_units != 0
+                                         ? minimum_chunk_units
+                                         : 1};
+  arena_create_with_options(a, &options);
 }
 
 // Prepends the new `Chunk`, of `byte_count` bytes, to the `a->chunk_list`.
 static void prepend_chunk(Arena* a, Chunk* chunk, size_t byte_count) {
   assert(page_size != 0);
-  assert(byte_count % page_size == 0);
+  assert(a->parent != NULL || byte_count % page_size == 0);
   if (a->chunk_list == NULL) {
     a->chunk_list = chunk;
     a->chunk_list->next = NULL;
@@ -76,200 +340,3493 @@ static void prepend_chunk(Arena* a, Chunk* chunk, size_t byte_count) {
   }
 }
 
-// Puts the memory region `p` points to back onto the free list. This function
-// is both part of the implementation of `arena_free` and of `get_more_memory`.
-static void free_internal(Arena* a, void* p) {
-  // The `Header` is always immediately before the region we returned to the
-  // caller of `malloc`.
-  Header* h = (Header*)p - 1;
+// The high bits of `Header.unit_count` are flags that describe the region, and
+// the low bits are its size in units. Use `get_units` and `set_units` to get at
+// the size.
+static const size_t unit_count_mask = SIZE_MAX >> 6;
 
-  // Iterate over `free_list` looking for the segment containing `h`.
-  Header* current;
-  for (current = a->free_list_start; !(h > current && h < current->next);
-       current = current->next) {
-    if (current >= current->next && (h > current || h < current->next)) {
-      // Freed block at start of end of arena.
-      break;
+// Set on a free region if all the bytes after its `Header` are known to be 0,
+// for example because they came fresh from the platform.
+//
+// Regions in a `Chunk` have it only while they are free, or while the arena
+// holds its lock. Once a caller (or a thread cache) has the region, other
+// threads can still set and clear its `previous_in_use_flag` (under the lock),
+// so the owner must not write to its `Header` without the lock, either: 1 of
+// the 2 updates would be lost.
+static const size_t zeroed_flag = (size_t)1 << (sizeof(size_t) * 8 - 1);
+
+// Set on an in-use region that has a `Mapping` of its own.
+static const size_t mapped_flag = (size_t)1 << (sizeof(size_t) * 8 - 2);
+
+// Set on a region that is in use (allocated, or in a thread’s cache), and clear
+// on a free one. Every `Chunk` ends with a 0-unit _fence_ `Header` that is
+// always in use, so that we never coalesce past the end of a chunk.
+static const size_t in_use_flag = (size_t)1 << (sizeof(size_t) * 8 - 3);
+
+// Set if the region immediately before this one is in use, or if there is none
+// (because this is the 1st region in its `Chunk`). If it is clear, the previous
+// region is free, and its footer (see `set_footer`) tells us where it starts.
+static const size_t previous_in_use_flag =
+    (size_t)1 << (sizeof(size_t) * 8 - 4);
+
+// Set on a region that was allocated as in region mode because the arena had a
+// mark (see `arena_mark`). Freeing it does nothing: `arena_release_to_mark`
+// reclaims it. Nothing else writes the `Header` of such a region, so threads
+// can read this flag without the lock.
+static const size_t scoped_flag = (size_t)1 << (sizeof(size_t) * 8 - 5);
+
+// Set on an in-use region that the profiler sampled (see
+// `ArenaOptions.sample_bytes`), so that freeing it knows to forget its
+// `Sample`. Like the other flags, it changes only under the lock.
+static const size_t sampled_flag = (size_t)1 << (sizeof(size_t) * 8 - 6);
+
+static size_t get_units(const Header* h) {
+  return h->unit_count & unit_count_mask;
+}
+
+// Sets the size of the region `h` describes, without changing its flags.
+static void set_units(Header* h, size_t unit_count) {
+  assert(unit_count <= unit_count_mask);
+  h->unit_count = (h->unit_count & ~unit_count_mask) | unit_count;
+}
+
+static bool has_flag(const Header* h, size_t flag) {
+  return (h->unit_count & flag) != 0;
+}
+
+static void set_flag(Header* h, size_t flag) {
+  h->unit_count |= flag;
+}
+
+static void clear_flag(Header* h, size_t flag) {
+  h->unit_count &= ~flag;
+}
+
+// Returns the region that immediately follows `h` in its `Chunk`.
+static Header* get_next_region(Header* h) {
+  return h + get_units(h);
+}
+
+// A free region carries _boundary tags_, so that a region being freed can find
+// its free neighbors, and unlink them from their lists, in O(1):
+//
+// * Its `Header.next` links it forward in its bin or in the free list, and the
+//   1st word after the `Header` links it back.
+// * Its last word, the _footer_, holds its size in units, so that the region
+//   after it can find its start.
+//
+// This is why regions are at least 2 units long. (In best-fit mode, the large
+// free regions use the rest of that 2nd unit, too; see `tree_insert`. And free
+// regions of at least 3 units keep their `get_free_epoch` in the word before
+// the footer.) In a free region with the `zeroed_flag`, every byte after the
+// `Header` is 0 except for that 2nd unit and the last; `take_region` clears
+// those when it hands the region out.
+static Header* get_previous(const Header* h) {
+  return h[1].next;
+}
+
+static void set_previous(Header* h, Header* previous) {
+  h[1].next = previous;
+}
+
+static void set_footer(Header* h) {
+  h[get_units(h) - 1].unit_count = get_units(h);
+}
+
+// Returns the `Arena.decay_epoch` in which the free region `h` became free, as
+// recorded by `link_free_region`. For 2-unit regions, whose last unit is also
+// their 2nd, returns 0; they are too small for `decay` to release anyway.
+static size_t get_free_epoch(const Header* h) {
+  const size_t unit_count = get_units(h);
+  return unit_count < 3 ? 0 : (size_t)(uintptr_t)h[unit_count - 1].next;
+}
+
+static void set_free_epoch(Header* h, size_t epoch) {
+  const size_t unit_count = get_units(h);
+  if (unit_count >= 3) {
+    h[unit_count - 1].next = (Header*)(uintptr_t)epoch;
+  }
+}
+
+// Splits the in-use region `h` so that it holds `unit_count` units, and returns
+// the rest as a separate in-use region, which inherits `h`’s `zeroed_flag` and
+// `scoped_flag`.
+static Header* split_in_use(Header* h, size_t unit_count) {
+  Header* tail = h + unit_count;
+  tail->unit_count = (get_units(h) - unit_count) | in_use_flag |
+                     previous_in_use_flag |
+                     (h->unit_count & (zeroed_flag | scoped_flag));
+  set_units(h, unit_count);
+  return tail;
+}
+
+// Appends the region `next`, which must immediately follow `h`, to `h`. Both
+// must be free (or about to be), and not on any list.
+static void join(Header* h, Header* next) {
+  const bool zeroed = has_flag(h, zeroed_flag) && has_flag(next, zeroed_flag);
+  const size_t next_units = get_units(next);
+  if (zeroed) {
+    // `h`’s last unit and `next`’s 1st 2 units are now in the middle of `h`’s
+    // zeroed bytes.
+    memset(&h[get_units(h) - 1], 0, sizeof(*h));
+    memset(next, 0, 2 * sizeof(*next));
+  } else {
+    clear_flag(h, zeroed_flag);
+  }
+  set_units(h, get_units(h) + next_units);
+}
+
+// Fills `byte_count` bytes at `p` with 0. For large regions, we ask the
+// platform to replace whole pages with fresh (zeroed, and not yet committed)
+// ones, which is much cheaper than writing them and also releases the memory.
+static void zero_region(void* p, size_t byte_count) {
+#if defined(__linux__)
+  if (byte_count >= madvise_zero_threshold) {
+    char* start = p;
+    char* end = start + byte_count;
+    char* first_page =
+        (char*)(((uintptr_t)start + page_size - 1) & ~(page_size - 1));
+    char* last_page = (char*)((uintptr_t)end & ~(page_size - 1));
+    if (madvise(first_page, (size_t)(last_page - first_page), MADV_DONTNEED) ==
+        0) {
+      memset(start, 0, (size_t)(first_page - start));
+      memset(last_page, 0, (size_t)(end - last_page));
+      return;
+    }
+  }
+#endif
+  memset(p, 0, byte_count);
+}
+
+static_assert(bin_count <= 64, "`Arena.bin_map` has too few bits");
+static_assert(exact_bin_count == 32 && maximum_binned_units == 1 << 13,
+              "Update `get_bin_index`");
+
+// Returns the index into `Arena.bins` for a region of `unit_count` units, which
+// must be at least 2 and less than `maximum_binned_units`.
+//
+// Small regions get a bin of their own. Above `exact_bin_count`, each power of
+// 2 is split into 4 bins by the 2 bits below the most significant bit, so that
+// the regions in any 1 bin are within 25% of each other in size.
+static size_t get_bin_index(size_t unit_count) {
+  assert(unit_count >= 2 && unit_count < maximum_binned_units);
+  if (unit_count < exact_bin_count) {
+    return unit_count;
+  }
+  const size_t log = sizeof(unsigned long long) * 8 - 1 -
+                     (size_t)__builtin_clzll((unsigned long long)unit_count);
+  return exact_bin_count + (log - 5) * 4 + ((unit_count >> (log - 2)) & 3);
+}
+
+// Returns true if a free region in `a` can shrink from `old_units` to
+// `new_units` without moving to a different list, or within the tree.
+static bool can_resize_in_place(const Arena* a, size_t old_units,
+                                size_t new_units) {
+  if (old_units >= maximum_binned_units || new_units >= maximum_binned_units) {
+    return old_units >= maximum_binned_units &&
+           new_units >= maximum_binned_units && a->fit_policy == arena_fit_next;
+  }
+  return get_bin_index(old_units) == get_bin_index(new_units);
+}
+
+// In best-fit mode, the free regions too large for the bins form an AVL tree,
+// stored in the regions themselves: a region’s `Header.next` is its left
+// child, and the 2nd unit holds its right child and its height. The tree is
+// ordered by size and then by address, so every key is unique.
+static Header* get_left(const Header* h) {
+  return h->next;
+}
+
+static Header* get_right(const Header* h) {
+  return h[1].next;
+}
+
+static size_t get_height(const Header* h) {
+  return h != NULL ? h[1].unit_count : 0;
+}
+
+static void set_children(Header* h, Header* left, Header* right) {
+  h->next = left;
+  h[1].next = right;
+  const size_t l = get_height(left), r = get_height(right);
+  h[1].unit_count = 1 + (l > r ? l : r);
+}
+
+static bool is_less(const Header* a, const Header* b) {
+  return get_units(a) < get_units(b) ||
+         (get_units(a) == get_units(b) && a < b);
+}
+
+// Restores the AVL balance of the subtree `h`, whose children are balanced
+// and differ in height by at most 2, and returns its new root.
+static Header* rebalance(Header* h) {
+  Header* left = get_left(h);
+  Header* right = get_right(h);
+  if (get_height(left) > get_height(right) + 1) {
+    if (get_height(get_left(left)) < get_height(get_right(left))) {
+      Header* pivot = get_right(left);
+      set_children(left, get_left(left), get_left(pivot));
+      set_children(pivot, left, get_right(pivot));
+      left = pivot;
+    }
+    set_children(h, get_right(left), right);
+    set_children(left, get_left(left), h);
+    return left;
+  }
+  if (get_height(right) > get_height(left) + 1) {
+    if (get_height(get_right(right)) < get_height(get_left(right))) {
+      Header* pivot = get_left(right);
+      set_children(right, get_right(pivot), get_right(right));
+      set_children(pivot, get_left(pivot), right);
+      right = pivot;
+    }
+    set_children(h, left, get_left(right));
+    set_children(right, h, get_right(right));
+    return right;
+  }
+  set_children(h, left, right);
+  return h;
+}
+
+// Inserts `h` into the subtree `root` and returns the subtree’s new root.
+static Header* tree_insert(Header* root, Header* h) {
+  if (root == NULL) {
+    set_children(h, NULL, NULL);
+    return h;
+  }
+  if (is_less(h, root)) {
+    root->next = tree_insert(get_left(root), h);
+  } else {
+    root[1].next = tree_insert(get_right(root), h);
+  }
+  return rebalance(root);
+}
+
+// Removes the least region from the subtree `root` into `*least` and returns
+// the subtree’s new root.
+static Header* tree_remove_least(Header* root, Header** least) {
+  if (get_left(root) == NULL) {
+    *least = root;
+    return get_right(root);
+  }
+  root->next = tree_remove_least(get_left(root), least);
+  return rebalance(root);
+}
+
+// Removes `h` from the subtree `root` and returns the subtree’s new root.
+static Header* tree_remove(Header* root, Header* h) {
+  if (root == h) {
+    if (get_right(h) == NULL) {
+      return get_left(h);
+    }
+    Header* successor;
+    Header* right = tree_remove_least(get_right(h), &successor);
+    set_children(successor, get_left(h), right);
+    return rebalance(successor);
+  }
+  if (is_less(h, root)) {
+    root->next = tree_remove(get_left(root), h);
+  } else {
+    root[1].next = tree_remove(get_right(root), h);
+  }
+  return rebalance(root);
+}
+
+// Returns the least region in the tree `root`, or `NULL` if it is empty.
+static Header* tree_first(Header* root) {
+  while (root != NULL && get_left(root) != NULL) {
+    root = get_left(root);
+  }
+  return root;
+}
+
+// Returns the least region in the tree `root` with at least `unit_count`
+// units, or `NULL` if there is none. Adds the number of regions it examined to
+// `*steps`.
+static Header* tree_find_fit(Header* root, size_t unit_count, size_t* steps) {
+  Header* fit = NULL;
+  while (root != NULL) {
+    (*steps)++;
+    if (get_units(root) >= unit_count) {
+      fit = root;
+      root = get_left(root);
+    } else {
+      root = get_right(root);
+    }
+  }
+  return fit;
+}
+
+// Returns the least region in the tree `root` that is greater than `h` (which
+// need not be in the tree any more), or `NULL` if there is none.
+static Header* tree_next(Header* root, const Header* h) {
+  Header* next = NULL;
+  while (root != NULL) {
+    if (is_less(h, root)) {
+      next = root;
+      root = get_left(root);
+    } else {
+      root = get_right(root);
+    }
+  }
+  return next;
+}
+
+// Writes the footer of the free region `h`, records that it became free in
+// `epoch`, and links it into the bin for its size or, if it is too large for
+// the bins, into the free list. There, `h` becomes the place where the next
+// search starts.
+static void link_free_region(Arena* a, Header* h, size_t epoch) {
+  set_footer(h);
+  set_free_epoch(h, epoch);
+  const size_t unit_count = get_units(h);
+  stats_subtract(&(a->stats.in_use_units), unit_count);
+  stats_add(&(a->stats.free_units), unit_count);
+  stats_add(&(a->stats.free_region_count), 1);
+  if (unit_count < maximum_binned_units) {
+    const size_t i = get_bin_index(unit_count);
+    h->next = a->bins[i];
+    set_previous(h, NULL);
+    if (h->next != NULL) {
+      set_previous(h->next, h);
     }
+    a->bins[i] = h;
+    a->bin_map |= (uint64_t)1 << i;
+  } else if (a->fit_policy == arena_fit_best) {
+    a->free_tree = tree_insert(a->free_tree, h);
+  } else if (a->free_list_start == NULL) {
+    h->next = h;
+    set_previous(h, h);
+    a->free_list_start = h;
+  } else {
+    Header* next = a->free_list_start;
+    Header* previous = get_previous(next);
+    h->next = next;
+    set_previous(h, previous);
+    previous->next = h;
+    set_previous(next, h);
+    a->free_list_start = h;
   }
+}
 
-  // If `h` is at the beginning of the segment, join it to the end.
-  if (h + h->unit_count == current->next) {
-    h->unit_count += current->next->unit_count;
-    h->next = current->next->next;
+// Unlinks the free region `h` from its bin or from the free list. Callers must
+// do this before changing `h`’s size.
+static void unlink_free_region(Arena* a, Header* h) {
+  Header* previous = get_previous(h);
+  const size_t unit_count = get_units(h);
+  stats_add(&(a->stats.in_use_units), unit_count);
+  stats_subtract(&(a->stats.free_units), unit_count);
+  stats_subtract(&(a->stats.free_region_count), 1);
+  if (unit_count < maximum_binned_units) {
+    if (previous != NULL) {
+      previous->next = h->next;
+    } else {
+      const size_t i = get_bin_index(unit_count);
+      a->bins[i] = h->next;
+      if (a->bins[i] == NULL) {
+        a->bin_map &= ~((uint64_t)1 << i);
+      }
+    }
+    if (h->next != NULL) {
+      set_previous(h->next, previous);
+    }
+  } else if (a->fit_policy == arena_fit_best) {
+    a->free_tree = tree_remove(a->free_tree, h);
+  } else if (h->next == h) {
+    a->free_list_start = NULL;
   } else {
-    h->next = current->next;
+    previous->next = h->next;
+    set_previous(h->next, previous);
+    if (a->free_list_start == h) {
+      a->free_list_start = h->next;
+    }
+  }
+}
+
+// Puts the in-use region `h` into the bins or onto the free list, coalescing
+// it with the free regions on either side of it. The result becomes free in
+// the current `Arena.decay_epoch`, unless most of it was free already: then it
+// keeps the epoch of its largest part, so that freeing a little next to a lot
+// of idle memory does not keep `decay` from releasing it. Must be called with
+// `a->lock` held.
+static void free_region(Arena* a, Header* h) {
+  size_t epoch = a->decay_epoch;
+  size_t epoch_units = get_units(h);
+  Header* next = get_next_region(h);
+  if (!has_flag(next, in_use_flag)) {
+    if (get_units(next) > epoch_units) {
+      epoch = get_free_epoch(next);
+      epoch_units = get_units(next);
+    }
+    unlink_free_region(a, next);
+    join(h, next);
   }
+  if (!has_flag(h, previous_in_use_flag)) {
+    Header* previous = h - h[-1].unit_count;
+    if (get_units(previous) > epoch_units) {
+      epoch = get_free_epoch(previous);
+    }
+    unlink_free_region(a, previous);
+    join(previous, h);
+    h = previous;
+  }
+  clear_flag(h, in_use_flag);
+  clear_flag(get_next_region(h), previous_in_use_flag);
+  link_free_region(a, h, epoch);
+}
 
-  // If `h` is at the end of the segment, join it to the beginning. These 2
-  // joins ensure that we coalesce segments into larger segments.
-  if (current + current->unit_count == h) {
-    current->unit_count += h->unit_count;
-    current->next = h->next;
+// Hands out `unit_count` units of the free region `h`: all of it, if the rest
+// would be too small to be a region of its own, or else its tail. Returns the
+// in-use region. Must be called with `a->lock` held.
+static Header* take_region(Arena* a, Header* h, size_t unit_count) {
+  const size_t rest = get_units(h) - unit_count;
+  Header* p = h;
+  if (rest < 2) {
+    unlink_free_region(a, h);
   } else {
-    current->next = h;
+    const size_t epoch = get_free_epoch(h);
+    if (can_resize_in_place(a, get_units(h), rest)) {
+      stats_add(&(a->stats.in_use_units), unit_count);
+      stats_subtract(&(a->stats.free_units), unit_count);
+      set_units(h, rest);
+      set_footer(h);
+      set_free_epoch(h, epoch);
+    } else {
+      unlink_free_region(a, h);
+      set_units(h, rest);
+      link_free_region(a, h, epoch);
+    }
+    p = h + rest;
+    p->unit_count = unit_count | (h->unit_count & zeroed_flag);
   }
+  set_flag(p, in_use_flag);
+  set_flag(get_next_region(p), previous_in_use_flag);
+  if (has_flag(p, zeroed_flag)) {
+    memset(p + 1, 0, sizeof(*p));
+    memset(&p[get_units(p) - 1], 0, sizeof(*p));
+  }
+  return p;
+}
 
-  a->free_list_start = current;
+// Returns a region of `unit_count` units (or 1 more; see `take_region`) from
+// the bins, splitting a larger binned region if necessary, or `NULL` if no
+// binned region is large enough. Adds the number of regions it examined to
+// `*steps`.
+static Header* take_from_bins(Arena* a, size_t unit_count, size_t* steps) {
+  if (unit_count >= maximum_binned_units) {
+    return NULL;
+  }
+  const size_t i = get_bin_index(unit_count);
+  Header* p = a->bins[i];
+  if (i >= exact_bin_count) {
+    // Regions in a log-spaced bin vary in size, so take the 1st that fits.
+    while (p != NULL && get_units(p) < unit_count) {
+      (*steps)++;
+      p = p->next;
+    }
+  }
+  if (p == NULL) {
+    // Every region in a higher bin is large enough, so the lowest non-empty
+    // one is our best candidate.
+    const uint64_t higher = a->bin_map & ~(((uint64_t)2 << i) - 1);
+    if (higher == 0) {
+      return NULL;
+    }
+    p = a->bins[__builtin_ctzll(higher)];
+  }
+  (*steps)++;
+  return take_region(a, p, unit_count);
 }
 
 // Returns a pointer to the 1st `Header` in the `Chunk`.
 static Header* get_1st_header(Chunk* chunk) {
-  // Advance past the 1st page, which we use solely for `a->chunk_list`. Yes, we
-  // waste 1 page just to hold the `Chunk` structure. The other alternative is
-  // to maintain a dedicated memory mapping for it. That could be more
-  // space-efficient, at the cost of additional code and (possibly?) reduced
-  // data locality.
-  char* char_chunk = ((char*)chunk) + page_size;
-
-  // Regarding this pointer trickery, clang warns us:
-  //
-  //   cast from 'char *' to 'Header *' (aka 'union header *') increases
-  //   required alignment from 1 to 8 [-Wcast-align]
-  //
-  // so we assert that we are still aligned, as documentation:
-  assert((uintptr_t)chunk % 8 == 0);
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wcast-align"
-  return (Header*)char_chunk;
-#pragma clang diagnostic pop
+  return chunk->start;
+}
+
+// Returns the size of the `Chunk` in units, not counting the fence at its end
+// (see `in_use_flag`).
+static size_t get_chunk_units(const Chunk* chunk) {
+  return chunk->byte_count / sizeof(Header) - 1;
+}
+
+// Makes all of `chunk` 1 in-use region, followed by the fence, and returns it.
+// Must be called with `a->lock` held.
+static Header* format_chunk(Arena* a, Chunk* chunk) {
+  Header* h = get_1st_header(chunk);
+  h->unit_count = get_chunk_units(chunk) | in_use_flag | previous_in_use_flag;
+  get_next_region(h)->unit_count = in_use_flag | previous_in_use_flag;
+  stats_add(&(a->stats.in_use_units), get_chunk_units(chunk));
+  return h;
 }
 
-// Returns a pointer to a memory region containing at least `count`
-// `Header`-sized objects.
+// The chunk map finds the `Chunk` that holds any address in constant time. It
+// is a radix tree of 3 levels, indexed by page number, that all arenas share:
+// each entry in a leaf points to the descriptor of the chunk that holds the
+// page, or is `NULL`. Nodes are created on demand with a compare-and-swap (and
+// never freed), and only the thread that maps or unmaps a chunk writes its
+// entries, so nobody needs a lock to use the map.
 //
-// Returns `NULL` and sets `errno` if there was an error.
-static Header* get_more_memory(Arena* a, size_t unit_count) {
-  unit_count =
-      unit_count < a->minimum_chunk_units ? a->minimum_chunk_units : unit_count;
-  size_t byte_count;
-  if (mul(unit_count, sizeof(Header), &byte_count) ||
-      add(byte_count, page_size, &byte_count)) {
-    errno = EINVAL;
+// The nodes are mapped, so their pages cost memory only once touched: about 8
+// bytes per page of chunk.
+enum {
+  chunk_map_level_bits = 12,
+  chunk_map_level_size = 1 << chunk_map_level_bits,
+  chunk_map_level_mask = chunk_map_level_size - 1,
+};
+
+// An interior node: the root, whose children are nodes, or a node whose
+// children are `ChunkMapLeaf`s.
+typedef struct ChunkMapNode {
+  _Atomic(void*) children[chunk_map_level_size];
+} ChunkMapNode;
+
+typedef struct ChunkMapLeaf {
+  _Atomic(Chunk*) chunks[chunk_map_level_size];
+} ChunkMapLeaf;
+
+static_assert(sizeof(ChunkMapNode) == sizeof(ChunkMapLeaf),
+              "`get_chunk_map_child` makes both kinds of node");
+
+// With 4 KiB pages, the root covers the 48-bit address spaces of x86-64 and
+// ARM64.
+static ChunkMapNode chunk_map;
+
+// Returns `node`’s child `i`, creating it first if it does not exist and
+// `create` is true. Returns `NULL` if the child does not exist, or (setting
+// `errno`) if we could not create it.
+static void* get_chunk_map_child(ChunkMapNode* node, size_t i, bool create) {
+  void* child =
+      atomic_load_explicit(&(node->children[i]), memory_order_acquire);
+  if (child != NULL || !create) {
+    return child;
+  }
+  void* new_child = mmap(NULL, sizeof(ChunkMapNode), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+  if (new_child == MAP_FAILED) {
     return NULL;
   }
+  if (atomic_compare_exchange_strong_explicit(&(node->children[i]), &child,
+                                              new_child, memory_order_acq_rel,
+                                              memory_order_acquire)) {
+    return new_child;
+  }
+  // Another thread created it while we were mapping ours.
+  if (munmap(new_child, sizeof(ChunkMapNode))) {
+    abort();
+  }
+  return child;
+}
 
-  Chunk* chunk = mmap(NULL, byte_count, PROT_READ | PROT_WRITE,
-                      MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-  if (chunk == MAP_FAILED) {
+// Returns the leaf of the chunk map that holds the entry for page number
+// `page`, as `get_chunk_map_child` does.
+static ChunkMapLeaf* get_chunk_map_leaf(uintptr_t page, bool create) {
+  const uintptr_t i = page >> (2 * chunk_map_level_bits);
+  if (i >= chunk_map_level_size) {
+    // No chunk can be there, so a lookup just finds nothing.
+    if (create) {
+      errno = ENOMEM;
+    }
     return NULL;
   }
-  prepend_chunk(a, chunk, byte_count);
+  ChunkMapNode* node = get_chunk_map_child(&chunk_map, i, create);
+  if (node == NULL) {
+    return NULL;
+  }
+  return get_chunk_map_child(
+      node, (page >> chunk_map_level_bits) & chunk_map_level_mask, create);
+}
 
-  Header* h = get_1st_header(chunk);
-  h->unit_count = unit_count;
-  free_internal(a, h + 1);
-  return a->free_list_start;
+// `page_size` is a power of 2, so a shift does what a (much slower) division
+// would.
+static uintptr_t get_page_number(const void* p) {
+  return (uintptr_t)p >> __builtin_ctzl(page_size);
 }
 
-// Computes the count of `Header`-sized units necessary to store `count * size`
-// bytes, + 1 for the actual `Header` metadata that describes the region.
-static size_t get_unit_count(size_t count, size_t size) {
-  size_t byte_count;
-  if (mul(count, size, &byte_count) || byte_count == 0) {
-    return 0;
-  }
-  size_t unit_count;
-  if (add(byte_count, sizeof(Header) - 1, &unit_count)) {
-    return 0;
+// Returns the `Chunk` that holds the address `p`, or `NULL` if no arena’s
+// chunk holds it.
+static Chunk* find_chunk(const void* p) {
+  const uintptr_t page = get_page_number(p);
+  ChunkMapLeaf* leaf = get_chunk_map_leaf(page, false);
+  if (leaf == NULL) {
+    return NULL;
   }
-  return unit_count / sizeof(Header) + 1;
+  return atomic_load_explicit(&(leaf->chunks[page & chunk_map_level_mask]),
+                              memory_order_acquire);
 }
 
-void* arena_malloc(Arena* a, size_t count, size_t size) {
-  const size_t unit_count = get_unit_count(count, size);
-  if (unit_count == 0) {
-    errno = EINVAL;
-    return NULL;
+// Points the chunk map’s entries for the pages of the `byte_count` bytes at
+// `start` (which is page-aligned) to `c`, which may be `NULL`. Returns false
+// and sets `errno` if there was an error, in which case the map is unchanged.
+static bool set_chunk_map(const void* start, size_t byte_count, Chunk* c) {
+  const uintptr_t first = get_page_number(start);
+  const uintptr_t end = first + (byte_count + page_size - 1) / page_size;
+  // Create all the leaves 1st, so that we fail before changing anything.
+  for (uintptr_t page = first; page < end;
+       page = (page | chunk_map_level_mask) + 1) {
+    if (get_chunk_map_leaf(page, true) == NULL) {
+      return false;
+    }
   }
+  for (uintptr_t page = first; page < end;) {
+    ChunkMapLeaf* leaf = get_chunk_map_leaf(page, false);
+    do {
+      atomic_store_explicit(&(leaf->chunks[page & chunk_map_level_mask]), c,
+                            memory_order_release);
+      page++;
+    } while (page < end && (page & chunk_map_level_mask) != 0);
+  }
+  return true;
+}
 
-  Header* p;
-  Header* previous;
-  lock(&(a->lock));
+// The chunk cache holds chunks that `arena_destroy` has released, so that
+// arenas created later can take them instead of calling `mmap`, and the
+// platform need not tear down and set up the mappings again. All arenas share
+// it, without a lock: each slot holds a chunk’s address, with its size in pages
+// in the low bits (which are 0 in a page-aligned address), or 0. 1
+// compare-and-swap puts a chunk into an empty slot or takes it out, and since
+// the address and size are 1 word, a taker can’t be fooled by a slot that has
+// been emptied and refilled in between.
+//
+// Cached chunks keep their pages (which is the point), so the cache holds at
+// most `chunk_cache_maximum_bytes`, and only chunks of fewer pages than there
+// are bytes in a page (16 MiB with 4 KiB pages).
+enum { chunk_cache_slot_count = 32 };
+static const size_t chunk_cache_maximum_bytes = (size_t)64 << 20;
+static _Atomic(uintptr_t) chunk_cache[chunk_cache_slot_count];
+static atomic_size_t chunk_cache_bytes;
 
-  // Determine whether `a->free_list` has been initialized. Note that if it has
-  // not been, the `for` loop below this one will fall through to the call to
-  // `get_more_memory` on the 1st iteration.
-  if ((previous = a->free_list_start) == NULL) {
-    a->free_list.next = a->free_list_start = previous = &(a->free_list);
-    a->free_list.unit_count = 0;
-  }
-
-  // Iterate down `a->free_list`, looking for regions large enough or requesting
-  // a new region from the platform.
-  for (p = previous->next; true; previous = p, p = p->next) {
-    if (p->unit_count >= unit_count) {
-      if (p->unit_count == unit_count) {
-        // If this region is exactly the size we need, we're done.
-        previous->next = p->next;
-      } else {
-        // If this region is larger than we need, return the tail end of it to
-        // the caller, and adjust the size of the region `Header`.
-        p->unit_count -= unit_count;
-        p += p->unit_count;
-        p->unit_count = unit_count;
-      }
-      a->free_list_start = previous;
-      unlock(&(a->lock));
-      return p + 1;
+// Puts the `byte_count` bytes at `start`, which no arena is using any more,
+// into the chunk cache. Returns false if the cache has no room for them.
+static bool put_in_chunk_cache(void* start, size_t byte_count) {
+  const size_t page_count = byte_count / page_size;
+  if (page_count >= page_size ||
+      atomic_fetch_add_explicit(&chunk_cache_bytes, byte_count,
+                                memory_order_relaxed) +
+              byte_count >
+          chunk_cache_maximum_bytes) {
+    if (page_count < page_size) {
+      atomic_fetch_sub_explicit(&chunk_cache_bytes, byte_count,
+                                memory_order_relaxed);
+    }
+    return false;
+  }
+  const uintptr_t entry = (uintptr_t)start | page_count;
+  for (size_t i = 0; i < chunk_cache_slot_count; i++) {
+    uintptr_t empty = 0;
+    if (atomic_compare_exchange_strong_explicit(&chunk_cache[i], &empty, entry,
+                                                memory_order_release,
+                                                memory_order_relaxed)) {
+      return true;
     }
+  }
+  atomic_fetch_sub_explicit(&chunk_cache_bytes, byte_count,
+                            memory_order_relaxed);
+  return false;
+}
 
-    // If we have wrapped around to the beginning of `free_list` (its end always
-    // points to its beginning), we need to get more memory.
-    if (p == a->free_list_start) {
-      if ((p = get_more_memory(a, unit_count)) == NULL) {
-        unlock(&(a->lock));
-        return NULL;
-      }
+// Takes a chunk of at least `*byte_count` bytes (but less than twice that) out
+// of the chunk cache, and sets `*byte_count` to its size. Returns `NULL` if
+// there is none.
+static void* take_from_chunk_cache(size_t* byte_count) {
+  for (size_t i = 0; i < chunk_cache_slot_count; i++) {
+    uintptr_t entry =
+        atomic_load_explicit(&chunk_cache[i], memory_order_relaxed);
+    const size_t n = (entry & (page_size - 1)) * page_size;
+    if (entry != 0 && n >= *byte_count && n / 2 < *byte_count &&
+        atomic_compare_exchange_strong_explicit(&chunk_cache[i], &entry, 0,
+                                                memory_order_acquire,
+                                                memory_order_relaxed)) {
+      atomic_fetch_sub_explicit(&chunk_cache_bytes, n, memory_order_relaxed);
+      *byte_count = n;
+      return (void*)(entry & ~(page_size - 1));
     }
   }
+  return NULL;
 }
 
-// Now that we have the `Chunk` information in the `Arena`, we can test to see
-// whether `p` is actually in any chunk we have allocated. That is still not a
-// perfect test that `p` is exactly a pointer previously returned by
-// `arena_malloc`, but it’s better than what we started with.
-//
-// `abort`s if `p` is not inside a known `Chunk`.
-static void check_free(Arena* a, void* p) {
-  const uintptr_t pu = (uintptr_t)p;
-  uintptr_t usable_start = 0, usable_end = 0;
-  for (Chunk* c = a->chunk_list; c != NULL; c = c->next) {
-    const uintptr_t cu = (uintptr_t)c;
-    assert(cu % page_size == 0);
-    usable_start = cu + page_size;
-    usable_end = cu + c->byte_count - sizeof(Header);
-    if (pu >= usable_start && pu <= usable_end) {
+// `arena_destroy` keeps the pages of `Chunk` descriptors that it frees here, as
+// it does chunks, so that a short-lived arena need not map (and fault in) a
+// page just for its descriptors. Each slot holds a `ChunkSlab` or `NULL`; the
+// slab’s old descriptors are simply forgotten.
+enum { chunk_slab_cache_slot_count = 32 };
+static _Atomic(ChunkSlab*) chunk_slab_cache[chunk_slab_cache_slot_count];
+
+// Puts `slab`, which no arena is using any more, into the cache, or unmaps it
+// if the cache is full.
+static void put_chunk_slab(ChunkSlab* slab) {
+  for (size_t i = 0; i < chunk_slab_cache_slot_count; i++) {
+    ChunkSlab* empty = NULL;
+    if (atomic_compare_exchange_strong_explicit(&chunk_slab_cache[i], &empty,
+                                                slab, memory_order_release,
+                                                memory_order_relaxed)) {
       return;
     }
   }
-  abort();
+  if (munmap(slab, page_size)) {
+    abort();
+  }
 }
 
-void arena_free(Arena* a, void* p) {
-  lock(&(a->lock));
-  if (do_check_free) {
-    check_free(a, p);
+// Takes a `ChunkSlab` out of the cache. Returns `NULL` if there is none.
+static ChunkSlab* take_chunk_slab(void) {
+  for (size_t i = 0; i < chunk_slab_cache_slot_count; i++) {
+    if (atomic_load_explicit(&chunk_slab_cache[i], memory_order_relaxed) ==
+        NULL) {
+      continue;
+    }
+    ChunkSlab* slab = atomic_exchange_explicit(&chunk_slab_cache[i], NULL,
+                                               memory_order_acquire);
+    if (slab != NULL) {
+      return slab;
+    }
   }
-  if (overwrite_on_free) {
-    const Header* h = (Header*)p - 1;
-    memset(p, overwrite_on_free_value, (h->unit_count - 1) * sizeof(Header));
+  return NULL;
+}
+
+void arena_release_cached_chunks(void) {
+  for (size_t i = 0; i < chunk_cache_slot_count; i++) {
+    const uintptr_t entry =
+        atomic_exchange_explicit(&chunk_cache[i], 0, memory_order_acquire);
+    if (entry == 0) {
+      continue;
+    }
+    const size_t n = (entry & (page_size - 1)) * page_size;
+    atomic_fetch_sub_explicit(&chunk_cache_bytes, n, memory_order_relaxed);
+    if (munmap((void*)(entry & ~(page_size - 1)), n)) {
+      abort();
+    }
+  }
+  for (size_t i = 0; i < chunk_slab_cache_slot_count; i++) {
+    ChunkSlab* slab = atomic_exchange_explicit(&chunk_slab_cache[i], NULL,
+                                               memory_order_acquire);
+    if (slab != NULL && munmap(slab, page_size)) {
+      abort();
+    }
   }
-  free_internal(a, p);
-  unlock(&(a->lock));
 }
 
-void arena_destroy(Arena* a) {
-  lock(&(a->lock));
-  for (Chunk* c = a->chunk_list; c != NULL;) {
-    Chunk* next = c->next;
-    if (munmap(c, c->byte_count)) {
+// Gives the `byte_count` bytes at `start`, the memory of a chunk of `a` that
+// is not in the chunk map, back to `a`’s parent, or to the platform, or (if
+// `cache`) to the chunk cache if it has room.
+static void put_chunk_memory(Arena* a, void* start, size_t byte_count,
+                             bool cache) {
+  if (a->parent != NULL) {
+    arena_free(a->parent, start);
+  } else if (!cache || a->use_huge_pages ||
+             !put_in_chunk_cache(start, byte_count)) {
+    if (munmap(start, byte_count)) {
       abort();
     }
-    c = next;
   }
-  a->chunk_list = NULL;
-  a->free_list_start = NULL;
-  memset(&(a->free_list), 0, sizeof(a->free_list));
-  unlock(&(a->lock));
+}
+
+// Takes the chunk `c` out of the chunk map, and gives its memory back (see
+// `put_chunk_memory`). Its descriptor is left for the caller to reuse.
+static void release_chunk(Chunk* c, bool cache) {
+  // A chunk from a parent arena is a region in 1 of the parent’s chunks, whose
+  // entries in the map must point to that chunk again.
+  set_chunk_map(c->start, c->byte_count, c->parent_chunk);
+  put_chunk_memory(c->arena, c->start, c->byte_count, cache);
+}
+
+// Returns a `Chunk` descriptor that is not in use, taking a `ChunkSlab` from
+// the cache or mapping a new 1 if necessary.
+//
+// Returns `NULL` and sets `errno` if there was an error. Must be called with
+// `a->lock` held, but releases it while waiting for the platform.
+static Chunk* take_chunk_descriptor(Arena* a) {
+  while (a->free_chunks == NULL) {
+    ChunkSlab* slab = take_chunk_slab();
+    if (slab == NULL) {
+      unlock(&(a->lock));
+      slab = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+      lock(&(a->lock));
+      if (slab == MAP_FAILED) {
+        return NULL;
+      }
+    }
+    slab->next = a->chunk_slabs;
+    a->chunk_slabs = slab;
+    Chunk* chunks = (Chunk*)(slab + 1);
+    const size_t count = (page_size - sizeof(ChunkSlab)) / sizeof(Chunk);
+    for (size_t i = 0; i < count; i++) {
+      chunks[i].next = a->free_chunks;
+      a->free_chunks = &chunks[i];
+    }
+  }
+  Chunk* c = a->free_chunks;
+  a->free_chunks = c->next;
+  return c;
+}
+
+// Makes the descriptor `c` available to `take_chunk_descriptor` again. Must be
+// called with `a->lock` held.
+static void put_chunk_descriptor(Arena* a, Chunk* c) {
+  c->next = a->free_chunks;
+  a->free_chunks = c;
+}
+
+// If the region `h` is the only region in its `Chunk`, returns the link in
+// `a->chunk_list` that points to the chunk. Otherwise, returns `NULL`.
+static Chunk** find_whole_chunk(Arena* a, const Header* h) {
+  // Every chunk’s 1st `Header` is page-aligned, so we can usually skip the
+  // lookup.
+  if ((uintptr_t)h % page_size != 0) {
+    return NULL;
+  }
+  Chunk* c = find_chunk(h);
+  if (c == NULL || get_1st_header(c) != h ||
+      get_chunk_units(c) != get_units(h)) {
+    return NULL;
+  }
+  // Whole free chunks are rare, so the search is not worth a doubly-linked
+  // list.
+  Chunk** link = &(a->chunk_list);
+  while (*link != c) {
+    link = &((*link)->next);
+  }
+  return link;
+}
+
+// Maps `byte_count` bytes (a multiple of `huge_page_size`), aligned to
+// `huge_page_size` and backed by huge pages if possible. Returns `MAP_FAILED`
+// and sets `errno` if there was an error.
+static void* map_huge_pages(size_t byte_count) {
+#if defined(__linux__)
+  // This fails unless the administrator has reserved huge pages.
+  void* p = mmap(NULL, byte_count, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, 0, 0);
+  if (p != MAP_FAILED) {
+    return p;
+  }
+
+  // Otherwise, map enough to be sure of an aligned run of `byte_count` bytes,
+  // and unmap the rest, so that transparent huge pages can back the whole
+  // chunk.
+  size_t reserved_byte_count;
+  if (add(byte_count, huge_page_size - page_size, &reserved_byte_count)) {
+    errno = ENOMEM;
+    return MAP_FAILED;
+  }
+  char* start = mmap(NULL, reserved_byte_count, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+  if (start == MAP_FAILED) {
+    return MAP_FAILED;
+  }
+  char* aligned = (char*)(((uintptr_t)start + huge_page_size - 1) &
+                          ~(huge_page_size - 1));
+  const size_t head = (size_t)(aligned - start);
+  const size_t tail = reserved_byte_count - head - byte_count;
+  if ((head != 0 && munmap(start, head)) ||
+      (tail != 0 && munmap(aligned + byte_count, tail))) {
+    abort();
+  }
+  // This is only advice: if the kernel has no transparent huge pages (or
+  // they are turned off), we still have a perfectly good chunk.
+  (void)madvise(aligned, byte_count, MADV_HUGEPAGE);
+  return aligned;
+#else
+  return mmap(NULL, byte_count, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+#endif
+}
+
+// The part of a new `Chunk` that 1 thread of `prefault` touches.
+typedef struct PrefaultSpan {
+  char* start;
+  size_t byte_count;
+} PrefaultSpan;
+
+// `prefault` uses at most this many threads.
+enum { maximum_prefault_thread_count = 64 };
+
+// Writes 1 byte in each page of the `PrefaultSpan` that `argument` points to.
+// (Reading is not enough: the platform maps a shared page of zeroes until the
+// 1st write.) The byte is 0, so the pages stay zeroed.
+static void* touch_pages(void* argument) {
+  const PrefaultSpan* s = argument;
+  for (size_t i = 0; i < s->byte_count; i += page_size) {
+    ((volatile char*)s->start)[i] = 0;
+  }
+  return NULL;
+}
+
+// Faults in the `byte_count` bytes at `start`, a new chunk’s memory, by
+// touching them: from this thread alone, or, if `parallel`, from 1 thread per
+// CPU. If we can’t start a thread, this thread does its part.
+static void prefault(void* start, size_t byte_count, bool parallel) {
+  const size_t page_count = byte_count / page_size;
+  size_t thread_count = 1;
+  if (parallel) {
+    const long n = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_count = n > 1 ? (size_t)n : 1;
+  }
+  if (thread_count > maximum_prefault_thread_count) {
+    thread_count = maximum_prefault_thread_count;
+  }
+  if (thread_count > page_count) {
+    thread_count = page_count;
+  }
+  PrefaultSpan spans[maximum_prefault_thread_count];
+  pthread_t threads[maximum_prefault_thread_count];
+  bool started[maximum_prefault_thread_count];
+  const size_t pages_per_thread = page_count / thread_count;
+  for (size_t i = 0; i < thread_count; i++) {
+    spans[i].start = (char*)start + i * pages_per_thread * page_size;
+    spans[i].byte_count =
+        (i + 1 < thread_count ? pages_per_thread
+                              : page_count - i * pages_per_thread) *
+        page_size;
+    started[i] = i != 0 &&
+                 pthread_create(&threads[i], NULL, touch_pages, &spans[i]) == 0;
+  }
+  for (size_t i = 0; i < thread_count; i++) {
+    if (!started[i]) {
+      touch_pages(&spans[i]);
+    }
+  }
+  for (size_t i = 1; i < thread_count; i++) {
+    if (started[i] && pthread_join(threads[i], NULL)) {
+      abort();
+    }
+  }
+}
+
+// Puts `a` on its parent’s list of children, if it is not there already, so
+// that resetting or destroying the parent can destroy `a` first. Returns false
+// and sets `errno` if the parent has a mark, whose release would take back a
+// chunk that `a` took from it now. Must be called without `a->lock` held.
+static bool join_parent(Arena* a) {
+  Arena* parent = a->parent;
+  lock(&(parent->lock));
+  const bool ok = parent->mark_depth == 0;
+  if (ok && !a->is_child) {
+    a->is_child = true;
+    a->previous_sibling = NULL;
+    a->next_sibling = parent->children;
+    if (parent->children != NULL) {
+      parent->children->previous_sibling = a;
+    }
+    parent->children = a;
+  }
+  unlock(&(parent->lock));
+  if (!ok) {
+    errno = EBUSY;
+  }
+  return ok;
+}
+
+// Takes `a` off its parent’s list of children, if it is on it.
+static void leave_parent(Arena* a) {
+  Arena* parent = a->parent;
+  if (parent == NULL) {
+    return;
+  }
+  lock(&(parent->lock));
+  if (a->is_child) {
+    if (a->previous_sibling != NULL) {
+      a->previous_sibling->next_sibling = a->next_sibling;
+    } else {
+      parent->children = a->next_sibling;
+    }
+    if (a->next_sibling != NULL) {
+      a->next_sibling->previous_sibling = a->previous_sibling;
+    }
+    a->next_sibling = a->previous_sibling = NULL;
+    a->is_child = false;
+  }
+  unlock(&(parent->lock));
+}
+
+// Destroys each of `a`’s children (which take themselves off the list). Must
+// be called without `a->lock` held, since the children give their chunks back
+// to `a`.
+static void destroy_children(Arena* a) {
+  for (;;) {
+    lock(&(a->lock));
+    Arena* child = a->children;
+    unlock(&(a->lock));
+    if (child == NULL) {
+      return;
+    }
+    arena_destroy(child);
+  }
+}
+
+// Child arenas get their chunks’ memory from their parents with this, which is
+// `arena_aligned_malloc` without the mappings (see `ArenaOptions.parent`).
+static Header* take_aligned(Arena* a, size_t alignment, size_t unit_count,
+                            bool* zeroed);
+
+// Returns the memory for a new chunk of `a` of `*byte_count` bytes: from `a`’s
+// parent, from the chunk cache (which may change `*byte_count`), or from the
+// platform. Sets `*zeroed` if the memory is known to be 0, and `*mapped` if it
+// came from the platform. If `flags` is not 0, the memory’s pages are faulted
+// in as `flags` says (see `ArenaReserveFlags`), wherever they came from:
+// reused memory may have had pages dropped by `zero_region` or `arena_trim`.
+//
+// Returns `MAP_FAILED` and sets `errno` if there was an error. Must be called
+// without `a->lock` held.
+static void* get_chunk_memory(Arena* a, size_t* byte_count, unsigned flags,
+                              bool* zeroed, bool* mapped) {
+  *zeroed = false;
+  *mapped = false;
+  void* start = NULL;
+  bool populated = false;
+  if (a->parent != NULL) {
+    // The chunk is a page-aligned region of the parent, 1 unit short of a whole
+    // number of pages, so that its `Header` and the next region’s fit in the
+    // ends of the pages before and after it. Then the next chunk the parent
+    // gives out can start on the very next page, without padding.
+    if (!join_parent(a)) {
+      return MAP_FAILED;
+    }
+    Header* h = take_aligned(a->parent, page_size,
+                             *byte_count / sizeof(Header), zeroed);
+    if (h == NULL) {
+      return MAP_FAILED;
+    }
+    start = h + 1;
+    *byte_count -= sizeof(Header);
+  } else if (!a->use_huge_pages) {
+    start = take_from_chunk_cache(byte_count);
+  }
+  if (start == NULL) {
+    // `MAP_POPULATE` would fault in the unaligned ends that `map_huge_pages`
+    // unmaps, and before it has asked for huge pages, so huge-page chunks are
+    // always touched instead.
+    populated = flags == arena_reserve_populate && map_populate != 0 &&
+                !a->use_huge_pages;
+    start = a->use_huge_pages
+                ? map_huge_pages(*byte_count)
+                : mmap(NULL, *byte_count, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS |
+                           (populated ? map_populate : 0),
+                       0, 0);
+    if (start == MAP_FAILED) {
+      return MAP_FAILED;
+    }
+    *zeroed = true;
+    *mapped = true;
+  }
+  if (flags != 0 && !populated) {
+    prefault(start, *byte_count, (flags & arena_reserve_parallel) != 0);
+  }
+  return start;
+}
+
+// Returns a new `Chunk` with room for at least `unit_count` units (and at
+// least `a->minimum_chunk_units`), not yet linked into `a->chunk_list`.
+// `flags` are the `ArenaReserveFlags` for the chunk’s pages, or 0 (see
+// `get_chunk_memory`).
+//
+// Returns `NULL` and sets `errno` if there was an error.
+//
+// Must be called with `a->lock` held, but releases it while waiting for the
+// platform, so callers must not assume that the arena is unchanged.
+static Chunk* map_chunk(Arena* a, size_t unit_count, unsigned flags) {
+  // Make room for the fence (out of the minimum, if we can), and for a child
+  // arena, the unit that its chunks are short (see `get_chunk_memory`). Round
+  // up to a whole number of pages. The caller gets the difference.
+  size_t byte_count, minimum_byte_count;
+  if (add(unit_count, a->parent != NULL ? 2 : 1, &unit_count) ||
+      mul(unit_count, sizeof(Header), &byte_count) ||
+      mul(a->minimum_chunk_units, sizeof(Header), &minimum_byte_count)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  byte_count =
+      byte_count < minimum_byte_count ? minimum_byte_count : byte_count;
+  const size_t granule = a->use_huge_pages ? huge_page_size : page_size;
+  if (add(byte_count, granule - 1, &byte_count)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  byte_count -= byte_count % granule;
+
+  Chunk* chunk = take_chunk_descriptor(a);
+  if (chunk == NULL) {
+    return NULL;
+  }
+  // `mmap` can be slow, so don’t make other threads wait for it. Nobody else
+  // can see `chunk` until we link it in.
+  unlock(&(a->lock));
+  bool zeroed, mapped;
+  void* start = get_chunk_memory(a, &byte_count, flags, &zeroed, &mapped);
+  chunk->next = NULL;
+  chunk->byte_count = byte_count;
+  chunk->start = start;
+  chunk->arena = a;
+  chunk->parent_chunk =
+      start != MAP_FAILED && a->parent != NULL ? find_chunk(start) : NULL;
+  chunk->dirty_units = zeroed ? 0 : get_chunk_units(chunk);
+  if (start != MAP_FAILED && !set_chunk_map(start, byte_count, chunk)) {
+    const int e = errno;
+    put_chunk_memory(a, start, byte_count, true);
+    errno = e;
+    start = MAP_FAILED;
+  }
+  lock(&(a->lock));
+  if (start == MAP_FAILED) {
+    put_chunk_descriptor(a, chunk);
+    return NULL;
+  }
+  stats_add(&(a->stats.chunk_count), 1);
+  stats_add(&(a->stats.chunk_bytes), byte_count);
+  stats_add(mapped ? &(a->stats.chunk_map_count)
+                   : &(a->stats.chunk_reuse_count),
+            1);
+  return chunk;
+}
+
+// Returns a new free region of at least `unit_count` units, in a new `Chunk`
+// (see `map_chunk` for `flags`).
+//
+// Returns `NULL` and sets `errno` if there was an error.
+//
+// Must be called with `a->lock` held, but releases it while waiting for the
+// platform, so callers must not assume that the free list is unchanged.
+static Header* get_more_memory(Arena* a, size_t unit_count, unsigned flags) {
+  Chunk* chunk = map_chunk(a, unit_count, flags);
+  if (chunk == NULL) {
+    return NULL;
+  }
+  prepend_chunk(a, chunk, chunk->byte_count);
+
+  Header* h = format_chunk(a, chunk);
+  if (chunk->dirty_units == 0) {
+    set_flag(h, zeroed_flag);
+  }
+  free_region(a, h);
+  return h;
+}
+
+// In region mode (or under a mark; see `arena_mark`), records how much of the
+// current `Chunk` we have used. Must be called with `a->lock` held.
+static void leave_region_chunk(Arena* a) {
+  Chunk* c = a->current_chunk;
+  if (c == NULL) {
+    return;
+  }
+  const size_t used = (size_t)(a->region_next - get_1st_header(c));
+  c->dirty_units = used > c->dirty_units ? used : c->dirty_units;
+}
+
+// In region mode (or under a mark), starts allocating from the beginning of
+// `c`. Must be called with `a->lock` held.
+static void enter_region_chunk(Arena* a, Chunk* c) {
+  leave_region_chunk(a);
+  a->current_chunk = c;
+  a->region_next = get_1st_header(c);
+  a->region_end = a->region_next + get_chunk_units(c);
+  a->region_clean = a->region_next + c->dirty_units;
+}
+
+// In region mode, moves on to a `Chunk` with room for `unit_count` units: the
+// next one in `a->chunk_list` (left over from before an `arena_reset`), if it
+// is large enough, or else a new one, which we insert after the current one.
+// Under a mark, outside region mode, the list is `a->scoped_chunks` instead.
+//
+// Returns false and sets `errno` if there was an error. Must be called with
+// `a->lock` held, but releases it while waiting for the platform.
+static bool advance_region(Arena* a, size_t unit_count) {
+  Chunk** const list = a->region ? &(a->chunk_list) : &(a->scoped_chunks);
+  Chunk* c = a->current_chunk;
+  Chunk* next = c != NULL ? c->next : *list;
+  if (next == NULL || get_chunk_units(next) < unit_count) {
+    next = map_chunk(a, unit_count, 0);
+    if (next == NULL) {
+      return false;
+    }
+    // Another thread may have moved on while we waited.
+    c = a->current_chunk;
+    Chunk** link = c != NULL ? &(c->next) : list;
+    next->next = *link;
+    *link = next;
+  }
+  enter_region_chunk(a, next);
+  return true;
+}
+
+// In region mode (or under a mark), returns a region of exactly `unit_count`
+// units from the current `Chunk`, moving on to another chunk if there is not
+// enough room.
+//
+// Returns `NULL` and sets `errno` if there was an error. Must be called with
+// `a->lock` held, but may release it while waiting for the platform.
+static Header* take_from_region(Arena* a, size_t unit_count) {
+  while ((size_t)(a->region_end - a->region_next) < unit_count) {
+    if (!advance_region(a, unit_count)) {
+      return NULL;
+    }
+  }
+  Header* h = a->region_next;
+  a->region_next += unit_count;
+  h->unit_count = unit_count | (a->region ? 0 : scoped_flag);
+  a->scoped_units += unit_count;
+  stats_add(&(a->stats.in_use_units), unit_count);
+  if (h >= a->region_clean) {
+    set_flag(h, zeroed_flag);
+  }
+  return h;
+}
+
+// Computes the count of `Header`-sized units necessary to store `count * size`
+// bytes, + 1 for the actual `Header` metadata that describes the region.
+static size_t get_unit_count(size_t count, size_t size) {
+  size_t byte_count;
+  if (mul(count, size, &byte_count) || byte_count == 0) {
+    return 0;
+  }
+  size_t unit_count;
+  if (add(byte_count, sizeof(Header) - 1, &unit_count)) {
+    return 0;
+  }
+  unit_count = unit_count / sizeof(Header) + 1;
+  return unit_count <= unit_count_mask ? unit_count : 0;
+}
+
+// Returns a region of `unit_count` units (or 1 more; see `take_region`) from
+// the free list, or from the platform if there is no region large enough on
+// the list. See `ArenaFitPolicy`. Adds the number of regions it examined to
+// `*steps`.
+//
+// Returns `NULL` and sets `errno` if there was an error.
+static Header* take_from_free_list(Arena* a, size_t unit_count,
+                                   size_t* steps) {
+  if (a->fit_policy == arena_fit_best) {
+    Header* h = tree_find_fit(a->free_tree, unit_count, steps);
+    if (h != NULL) {
+      return take_region(a, h, unit_count);
+    }
+  }
+  Header* const start = a->free_list_start;
+  if (start != NULL) {
+    Header* h = start;
+    do {
+      (*steps)++;
+      if (get_units(h) >= unit_count) {
+        a->free_list_start = h;
+        return take_region(a, h, unit_count);
+      }
+      h = h->next;
+    } while (h != start);
+  }
+  Header* h = get_more_memory(a, unit_count, 0);
+  return h != NULL ? take_region(a, h, unit_count) : NULL;
+}
+
+// Returns the bucket of `ArenaStats.search_steps` that counts searches that
+// examined `steps` regions.
+static size_t get_search_bucket(size_t steps) {
+  if (steps == 0) {
+    return 0;
+  }
+  const size_t bucket = 64 - (size_t)__builtin_clzll(steps);
+  return bucket < arena_search_step_bucket_count
+             ? bucket
+             : arena_search_step_bucket_count - 1;
+}
+
+// Returns a region of `unit_count` units (or 1 more; see `take_region`), from
+// the bins if possible.
+//
+// Returns `NULL` and sets `errno` if there was an error.
+static Header* allocate_units(Arena* a, size_t unit_count) {
+  if (a->region || a->mark_depth != 0) {
+    return take_from_region(a, unit_count);
+  }
+  size_t steps = 0;
+  Header* p = take_from_bins(a, unit_count, &steps);
+  if (p == NULL) {
+    p = take_from_free_list(a, unit_count, &steps);
+  }
+  stats_add(&(a->stats.search_steps[get_search_bucket(steps)]), 1);
+  return p;
+}
+
+// Frees the in-use region `h`. In region mode, the region is simply abandoned
+// until `arena_reset` (and regions allocated under a mark, until the mark is
+// released).
+static void free_units(Arena* a, Header* h) {
+  if (!a->region && !has_flag(h, scoped_flag)) {
+    free_region(a, h);
+  }
+}
+
+// Overwrites the bytes of the in-use region `h`, or not, according to
+// `overwrite_on_free`. This is the slow part of freeing, so it happens without
+// the lock; `mark_scrubbed` then records it in the `Header`.
+static void scrub(Header* h) {
+  if (overwrite_on_free) {
+    zero_region(h + 1, (get_units(h) - 1) * sizeof(Header));
+  }
+}
+
+// Sets the `zeroed_flag` of the in-use region `h` if `scrub` zeroed it. Must
+// be called with `a->lock` held (see `zeroed_flag`).
+static void mark_scrubbed(Header* h) {
+  if (overwrite_on_free) {
+    set_flag(h, zeroed_flag);
+  }
+}
+
+// Pushes the in-use region `h` onto `a`’s stack of remote frees (see
+// `ArenaOptions.remote_frees`). `h->next` is ours to use: nothing reads it
+// while the region is in use.
+static void push_remote_free(Arena* a, Header* h) {
+  Header* top = atomic_load_explicit(&(a->remote_frees), memory_order_relaxed);
+  do {
+    h->next = top;
+  } while (!atomic_compare_exchange_weak_explicit(&(a->remote_frees), &top, h,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+  atomic_fetch_add_explicit(&(a->stats.remote_free_count), 1,
+                            memory_order_relaxed);
+}
+
+// Frees the regions on `a`’s stack of remote frees. Must be called with
+// `a->lock` held.
+static void free_remote_frees(Arena* a) {
+  // The plain load is cheap, and usually finds the stack empty; only take the
+  // stack (and its cache line) when there is something on it.
+  if (atomic_load_explicit(&(a->remote_frees), memory_order_relaxed) == NULL) {
+    return;
+  }
+  Header* h = atomic_exchange_explicit(&(a->remote_frees), NULL,
+                                       memory_order_acquire);
+  size_t count = 0;
+  while (h != NULL) {
+    Header* next = h->next;
+    mark_scrubbed(h);
+    free_units(a, h);
+    count++;
+    h = next;
+  }
+  stats_add(&(a->stats.free_count), count);
+}
+
+// Each bin of a `ThreadCache` holds at most this many regions. When a bin runs
+// dry or fills up, we move `thread_cache_batch` regions between it and the
+// arena in 1 critical section.
+enum {
+  thread_cache_bin_capacity = 32,
+  thread_cache_batch = thread_cache_bin_capacity / 2,
+};
+
+// A per-thread cache of small regions from 1 `Arena`, with a bin (a
+// singly-linked list through `Header.next`) for each exact unit count below
+// `exact_bin_count`. Only the owning thread touches `bins` and `counts`, except
+// for `arena_destroy`. `arena`, `next`, and `previous` are protected by the
+// arena’s lock.
+typedef struct ThreadCache {
+  Arena* arena;
+  struct ThreadCache* next;
+  struct ThreadCache* previous;
+  Header* bins[exact_bin_count];
+  uint8_t counts[exact_bin_count];
+
+  // Allocations and frees that the cache has served since it last added them
+  // to the arena’s `Stats`. See `add_thread_cache_stats`.
+  size_t allocation_count;
+  size_t free_count;
+} ThreadCache;
+
+static _Thread_local ThreadCache thread_cache;
+
+// We use a `pthread_key_t` only for its destructor, which flushes the exiting
+// thread’s cache back to its arena.
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_key_once = PTHREAD_ONCE_INIT;
+
+// True while `get_thread_cache` is setting up the calling thread’s key. The
+// platform may allocate memory to do that (glibc does, for all but the 1st 32
+// keys), and if `arena_malloc` is the process’ `malloc` (see arena_preload.c),
+// that allocation comes back here. It must not use the cache.
+static _Thread_local bool binding_thread_cache;
+
+// Moves up to `count` regions from bin `i` of `c` back to `c->arena`. Must be
+// called with the arena’s lock held.
+static void flush_thread_cache_bin(ThreadCache* c, size_t i, size_t count) {
+  for (; count > 0 && c->bins[i] != NULL; count--) {
+    Header* h = c->bins[i];
+    c->bins[i] = h->next;
+    c->counts[i]--;
+    mark_scrubbed(h);
+    free_units(c->arena, h);
+  }
+}
+
+// Adds the allocations and frees that `c` has served to its arena’s `Stats`.
+// The cache counts them on its own, so that they cost no more than the
+// allocations and frees themselves, and we add them up whenever the cache
+// takes the arena’s lock anyway. Must be called with the arena’s lock held.
+static void add_thread_cache_stats(ThreadCache* c) {
+  stats_add(&(c->arena->stats.allocation_count), c->allocation_count);
+  stats_add(&(c->arena->stats.free_count), c->free_count);
+  c->allocation_count = 0;
+  c->free_count = 0;
+}
+
+// Unlinks `c` from its arena and empties it, without returning its regions to
+// the arena. Must be called with the arena’s lock held.
+static void detach_thread_cache(ThreadCache* c) {
+  add_thread_cache_stats(c);
+  if (c->previous != NULL) {
+    c->previous->next = c->next;
+  } else {
+    c->arena->thread_caches = c->next;
+  }
+  if (c->next != NULL) {
+    c->next->previous = c->previous;
+  }
+  memset(c, 0, sizeof(*c));
+}
+
+// Moves all of `c`’s regions back to its arena, and unbinds it.
+static void flush_thread_cache(ThreadCache* c) {
+  Arena* a = c->arena;
+  if (a == NULL) {
+    return;
+  }
+  lock(&(a->lock));
+  for (size_t i = 0; i < exact_bin_count; i++) {
+    flush_thread_cache_bin(c, i, thread_cache_bin_capacity);
+  }
+  detach_thread_cache(c);
+  unlock(&(a->lock));
+}
+
+static void flush_thread_cache_at_exit(void* p) {
+  flush_thread_cache(p);
+}
+
+static void create_thread_cache_key(void) {
+  if (pthread_key_create(&thread_cache_key, flush_thread_cache_at_exit)) {
+    abort();
+  }
+}
+
+// Returns the calling thread’s cache if it is (or can now be) bound to `a`, or
+// `NULL` if it is bound to some other arena.
+//
+// If `allocating` from an arena in an `ArenaSet`, and the cache is bound to
+// another arena in a set, the thread has moved to another CPU: the cache goes
+// back to its old arena and comes along to `a`. Frees do not move it, since
+// they go to whichever arena the region came from, not the thread’s CPU’s.
+static ThreadCache* get_thread_cache(Arena* a, bool allocating) {
+  ThreadCache* c = &thread_cache;
+  if (c->arena == a) {
+    return c;
+  }
+  if (binding_thread_cache) {
+    return NULL;
+  }
+  if (c->arena != NULL) {
+    if (!allocating || !a->in_set || !c->arena->in_set) {
+      return NULL;
+    }
+    flush_thread_cache(c);
+  }
+  binding_thread_cache = true;
+  const bool bound =
+      pthread_once(&thread_cache_key_once, create_thread_cache_key) == 0 &&
+      pthread_setspecific(thread_cache_key, c) == 0;
+  binding_thread_cache = false;
+  if (!bound) {
+    return NULL;
+  }
+  lock(&(a->lock));
+  c->arena = a;
+  c->previous = NULL;
+  c->next = a->thread_caches;
+  if (c->next != NULL) {
+    c->next->previous = c;
+  }
+  a->thread_caches = c;
+  unlock(&(a->lock));
+  return c;
+}
+
+// Returns a region of exactly `unit_count` units from the calling thread’s
+// cache, refilling the cache from `a` if necessary. Returns `NULL` if the
+// cache cannot serve the request.
+static Header* take_from_thread_cache(Arena* a, size_t unit_count) {
+  ThreadCache* c = get_thread_cache(a, true);
+  if (c == NULL) {
+    return NULL;
+  }
+  if (c->bins[unit_count] == NULL) {
+    lock(&(a->lock));
+    add_thread_cache_stats(c);
+    free_remote_frees(a);
+    for (size_t i = 0; i < thread_cache_batch; i++) {
+      Header* h = allocate_units(a, unit_count);
+      if (h == NULL) {
+        break;
+      }
+      clear_flag(h, zeroed_flag);
+      h->next = c->bins[unit_count];
+      c->bins[unit_count] = h;
+      c->counts[unit_count]++;
+    }
+    unlock(&(a->lock));
+    if (c->bins[unit_count] == NULL) {
+      return NULL;
+    }
+  }
+  Header* h = c->bins[unit_count];
+  c->bins[unit_count] = h->next;
+  c->counts[unit_count]--;
+  c->allocation_count++;
+  return h;
+}
+
+// Puts `h` into the calling thread’s cache, flushing part of the cache back to
+// `a` if it is full. Returns false if the cache cannot take `h`.
+static bool put_in_thread_cache(Arena* a, Header* h) {
+  const size_t i = get_units(h);
+  if (i >= exact_bin_count) {
+    return false;
+  }
+  ThreadCache* c = get_thread_cache(a, false);
+  if (c == NULL) {
+    return false;
+  }
+  h->next = c->bins[i];
+  c->bins[i] = h;
+  c->free_count++;
+  if (++c->counts[i] > thread_cache_bin_capacity) {
+    lock(&(a->lock));
+    add_thread_cache_stats(c);
+    flush_thread_cache_bin(c, i, thread_cache_batch);
+    unlock(&(a->lock));
+  }
+  return true;
+}
+
+static Header* get_mapped_header(Mapping* m) {
+  return (Header*)(m + 1);
+}
+
+static Mapping* get_mapping(Header* h) {
+  return (Mapping*)h - 1;
+}
+
+// Returns the address of the 1st page of the mapping that holds `m` and its
+// region `h`.
+static uintptr_t get_mapping_start(const Mapping* m) {
+  return (uintptr_t)m - (uintptr_t)m % page_size;
+}
+
+static size_t get_mapping_size(const Mapping* m, const Header* h) {
+  return (uintptr_t)(h + get_units(h)) - get_mapping_start(m);
+}
+
+// Returns how many bytes into its 1st page a `Mapping` must start so that its
+// region is aligned to `alignment` (which must be a power of 2, and at most
+// `page_size`).
+static size_t get_mapping_offset(size_t alignment) {
+  const size_t prefix = sizeof(Mapping) + sizeof(Header);
+  return (alignment - prefix % alignment) % alignment;
+}
+
+// Computes the size of a mapping that starts with `offset` bytes of padding and
+// holds a region of at least `unit_count` units. Returns 0 on overflow.
+static size_t get_mapping_byte_count(size_t unit_count, size_t offset) {
+  size_t byte_count;
+  if (mul(unit_count, sizeof(Header), &byte_count) ||
+      add(byte_count, offset + sizeof(Mapping) + page_size - 1, &byte_count)) {
+    return 0;
+  }
+  return byte_count - byte_count % page_size;
+}
+
+// Must be called with `a->lock` held.
+static void link_mapping(Arena* a, Mapping* m) {
+  Header* h = get_mapped_header(m);
+  stats_add(&(a->stats.in_use_units), get_units(h));
+  stats_add(&(a->stats.mapping_count), 1);
+  stats_add(&(a->stats.mapping_bytes), get_mapping_size(m, h));
+  m->previous = NULL;
+  m->next = a->mappings;
+  if (m->next != NULL) {
+    m->next->previous = m;
+  }
+  a->mappings = m;
+}
+
+// Must be called with `a->lock` held.
+static void unlink_mapping(Arena* a, Mapping* m) {
+  Header* h = get_mapped_header(m);
+  stats_subtract(&(a->stats.in_use_units), get_units(h));
+  stats_subtract(&(a->stats.mapping_count), 1);
+  stats_subtract(&(a->stats.mapping_bytes), get_mapping_size(m, h));
+  if (m->previous != NULL) {
+    m->previous->next = m->next;
+  } else {
+    a->mappings = m->next;
+  }
+  if (m->next != NULL) {
+    m->next->previous = m->previous;
+  }
+}
+
+// Returns a region of at least `unit_count` units in a new mapping of its own,
+// aligned to `alignment` (which must be a power of 2, and at most `page_size`).
+// Large regions get their own mappings so that they stay off the free list, and
+// so that we can return them to the platform as soon as they are freed.
+//
+// Returns `NULL` and sets `errno` if there was an error. Must be called without
+// `a->lock` held.
+static Header* map_region(Arena* a, size_t unit_count, size_t alignment) {
+  const size_t offset = get_mapping_offset(alignment);
+  const size_t byte_count = get_mapping_byte_count(unit_count, offset);
+  if (byte_count == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  char* start = mmap(NULL, byte_count, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+  if (start == MAP_FAILED) {
+    return NULL;
+  }
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wcast-align"
+  Mapping* m = (Mapping*)(start + offset);
+#pragma clang diagnostic pop
+  m->arena = a;
+  Header* h = get_mapped_header(m);
+  h->unit_count = (byte_count - offset - sizeof(Mapping)) / sizeof(Header);
+  set_flag(h, zeroed_flag | mapped_flag);
+
+  lock(&(a->lock));
+  m->serial = a->next_mapping_serial++;
+  link_mapping(a, m);
+  stats_add(&(a->stats.allocation_count), 1);
+  unlock(&(a->lock));
+  return h;
+}
+
+// Returns the in-use region `h`, which has a mapping of its own, to the
+// platform. Must be called without `a->lock` held.
+static void unmap_region(Arena* a, Header* h) {
+  Mapping* m = get_mapping(h);
+  lock(&(a->lock));
+  unlink_mapping(a, m);
+  stats_add(&(a->stats.free_count), 1);
+  unlock(&(a->lock));
+  if (munmap((void*)get_mapping_start(m), get_mapping_size(m, h))) {
+    abort();
+  }
+}
+
+// Unmaps every region in the list of `Mapping`s that starts with `m`.
+static void unmap_all(Mapping* m) {
+  while (m != NULL) {
+    Mapping* next = m->next;
+    if (munmap((void*)get_mapping_start(m),
+               get_mapping_size(m, get_mapped_header(m)))) {
+      abort();
+    }
+    m = next;
+  }
+}
+
+// Resizes the mapping of the in-use region `h` so that `h` holds at least
+// `unit_count` units, preserving its alignment within the page. Returns the new
+// `Header` for the region, or `NULL` if the platform could not remap it. Must
+// be called without `a->lock` held.
+static Header* remap_region(Arena* a, Header* h, size_t unit_count) {
+#if defined(__linux__)
+  Mapping* m = get_mapping(h);
+  const uintptr_t start = get_mapping_start(m);
+  const size_t offset = (uintptr_t)m - start;
+  const size_t byte_count = get_mapping_byte_count(unit_count, offset);
+  if (byte_count == 0) {
+    return NULL;
+  }
+
+  // As in `remap_chunk`, we only need the lock to unlink `m` and link it back
+  // in.
+  lock(&(a->lock));
+  unlink_mapping(a, m);
+  unlock(&(a->lock));
+  char* remapped = mremap((void*)start, get_mapping_size(m, h), byte_count,
+                          MREMAP_MAYMOVE);
+  if (remapped != MAP_FAILED) {
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wcast-align"
+    m = (Mapping*)(remapped + offset);
+#pragma clang diagnostic pop
+    h = get_mapped_header(m);
+    set_units(h, (byte_count - offset - sizeof(Mapping)) / sizeof(Header));
+  }
+  lock(&(a->lock));
+  link_mapping(a, m);
+  unlock(&(a->lock));
+  return remapped != MAP_FAILED ? h : NULL;
+#else
+  (void)a;
+  (void)h;
+  (void)unit_count;
+  return NULL;
+#endif
+}
+
+// The profiler (see `ArenaOptions.sample_bytes`) keeps 1 `Sample` for each
+// live region that it sampled: where the region is, how many bytes the caller
+// asked for, and the return addresses on the stack when it was allocated.
+enum { sample_frame_count = 32 };
+
+typedef struct Sample {
+  struct Sample* next;
+  Header* region;
+  size_t byte_count;
+  size_t serial;
+  size_t frame_count;
+  void* frames[sample_frame_count];
+} Sample;
+
+// A `SampleSlab` is a page of `Sample`s, as a `ChunkSlab` is of `Chunk`s.
+typedef struct SampleSlab {
+  struct SampleSlab* next;
+} SampleSlab;
+
+// How many more bytes the calling thread can allocate before its next sample,
+// or 0 if it has not started counting. All arenas share the countdown.
+static _Thread_local size_t bytes_until_sample;
+
+// True while the calling thread is taking a sample. Getting the call stack may
+// allocate (glibc loads libgcc_s the 1st time), and if `arena_malloc` is the
+// process’ `malloc` (see arena_preload.c), that allocation must not try to
+// take a sample in turn.
+static _Thread_local bool taking_sample;
+
+static _Thread_local uint64_t sample_random_state;
+
+// Returns a pseudo-random number (xorshift64). Each thread’s state starts from
+// a hash (splitmix64’s) of its address.
+static uint64_t get_sample_random(void) {
+  uint64_t x = sample_random_state;
+  if (x == 0) {
+    x = (uint64_t)(uintptr_t)&sample_random_state ^ 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    x = (x ^ (x >> 31)) | 1;
+  }
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  sample_random_state = x;
+  return x;
+}
+
+// Returns the natural logarithm of `x`, for 0 < `x` <= 1, so that we need not
+// link libm just for `log`. We double `x` into [0.5, 1], where the series for
+// ln(x) = 2 atanh((x - 1) / (x + 1)) converges quickly.
+static double get_log(double x) {
+  int doublings = 0;
+  while (x < 0.5) {
+    x *= 2;
+    doublings++;
+  }
+  const double z = (x - 1) / (x + 1);
+  const double z_squared = z * z;
+  double power = z;
+  double sum = 0;
+  for (int i = 1; i < 32; i += 2) {
+    sum += power / (double)i;
+    power *= z_squared;
+  }
+  return 2 * sum - (double)doublings * 0.6931471805599453;
+}
+
+// Returns how many bytes to count down before the next sample. The intervals
+// are exponentially distributed with mean `a->sample_bytes`, so that every
+// allocated byte is equally likely to be the one that is sampled, and an
+// allocation of n bytes is sampled with probability 1 - e^(-n / sample_bytes).
+// That is the model `pprof` assumes when it scales the samples back up.
+static size_t get_sample_interval(const Arena* a) {
+  // In (0, 1], so that the logarithm is finite.
+  const double u = (double)((get_sample_random() >> 11) + 1) * 0x1p-53;
+  const double interval = -get_log(u) * (double)a->sample_bytes;
+  if (interval >= (double)(SIZE_MAX / 2)) {
+    return SIZE_MAX / 2;
+  }
+  return interval < 1 ? 1 : (size_t)interval;
+}
+
+// Returns the bucket of `a->samples` for the region `h`.
+static Sample** get_sample_bucket(Arena* a, const Header* h) {
+  const size_t bucket_count = page_size / sizeof(Sample*);
+  return &(a->samples[(uintptr_t)h / sizeof(Header) % bucket_count]);
+}
+
+// Returns a `Sample` that is not in use, mapping the hash table and a new
+// `SampleSlab` if necessary.
+//
+// Returns `NULL` and sets `errno` if there was an error. Must be called with
+// `a->lock` held, but releases it while waiting for the platform.
+static Sample* take_sample_record(Arena* a) {
+  while (a->samples == NULL) {
+    unlock(&(a->lock));
+    Sample** samples = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+    lock(&(a->lock));
+    if (samples == MAP_FAILED) {
+      return NULL;
+    }
+    if (a->samples == NULL) {
+      a->samples = samples;
+    } else if (munmap(samples, page_size)) {
+      // Another thread mapped the table while we waited.
+      abort();
+    }
+  }
+  while (a->free_samples == NULL) {
+    unlock(&(a->lock));
+    SampleSlab* slab = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+    lock(&(a->lock));
+    if (slab == MAP_FAILED) {
+      return NULL;
+    }
+    slab->next = a->sample_slabs;
+    a->sample_slabs = slab;
+    Sample* samples = (Sample*)(slab + 1);
+    const size_t count = (page_size - sizeof(SampleSlab)) / sizeof(Sample);
+    for (size_t i = 0; i < count; i++) {
+      samples[i].next = a->free_samples;
+      a->free_samples = &samples[i];
+    }
+  }
+  Sample* s = a->free_samples;
+  a->free_samples = s->next;
+  return s;
+}
+
+// Makes the record `s` available to `take_sample_record` again. Must be called
+// with `a->lock` held.
+static void put_sample_record(Arena* a, Sample* s) {
+  s->next = a->free_samples;
+  a->free_samples = s;
+  stats_subtract(&(a->stats.sample_count), 1);
+}
+
+// Forgets the `Sample` of the region `h`, which is being freed or resized.
+// Must be called with `a->lock` held.
+static void forget_sample(Arena* a, Header* h) {
+  clear_flag(h, sampled_flag);
+  for (Sample** link = get_sample_bucket(a, h); *link != NULL;
+       link = &((*link)->next)) {
+    Sample* s = *link;
+    if (s->region == h) {
+      *link = s->next;
+      put_sample_record(a, s);
+      return;
+    }
+  }
+}
+
+// Samples the new region `h`, of `byte_count` requested bytes, if that uses up
+// the calling thread’s countdown, and returns true if it did. If `h` already
+// has a sample (because `arena_realloc` resized it in place), the new sample
+// replaces it. The profile is best-effort: if we cannot get a record for the
+// sample, we go without. Must be called without `a->lock` held.
+static __attribute__((noinline)) bool take_sample(Arena* a, Header* h,
+                                                  size_t byte_count) {
+  if (taking_sample) {
+    return false;
+  }
+  if (bytes_until_sample == 0) {
+    // This is the thread’s 1st allocation: start counting down.
+    bytes_until_sample = get_sample_interval(a);
+    if (bytes_until_sample > byte_count) {
+      bytes_until_sample -= byte_count;
+      return false;
+    }
+  }
+  bytes_until_sample = get_sample_interval(a);
+
+  void* frames[sample_frame_count + 1];
+  size_t frame_count = 0;
+  taking_sample = true;
+#if __has_include(<execinfo.h>)
+  // The 1st frame is this function’s own.
+  const int depth = backtrace(frames, sample_frame_count + 1);
+  if (depth > 1) {
+    frame_count = (size_t)depth - 1;
+    memmove(frames, frames + 1, frame_count * sizeof(frames[0]));
+  }
+#else
+  frames[0] = __builtin_return_address(0);
+  frame_count = 1;
+#endif
+  taking_sample = false;
+
+  lock(&(a->lock));
+  // Forgetting the old sample 1st lets its record be reused at once, so
+  // `take_sample_record` keeps the lock.
+  if (has_flag(h, sampled_flag)) {
+    forget_sample(a, h);
+  }
+  Sample* s = take_sample_record(a);
+  if (s != NULL) {
+    s->region = h;
+    s->byte_count = byte_count;
+    s->serial = a->next_sample_serial++;
+    s->frame_count = frame_count;
+    memcpy(s->frames, frames, frame_count * sizeof(frames[0]));
+    Sample** bucket = get_sample_bucket(a, h);
+    s->next = *bucket;
+    *bucket = s;
+    set_flag(h, sampled_flag);
+    stats_add(&(a->stats.sample_count), 1);
+  }
+  unlock(&(a->lock));
+  return true;
+}
+
+// Counts the new region `h`, of `byte_count` requested bytes, toward the
+// calling thread’s next sample, and returns true if it took 1 (see
+// `take_sample`). For most allocations, this is all that the profiler costs.
+// Must be called without `a->lock` held.
+static bool count_sample_bytes(Arena* a, Header* h, size_t byte_count) {
+  if (a->sample_bytes == 0) {
+    return false;
+  }
+  if (bytes_until_sample > byte_count) {
+    bytes_until_sample -= byte_count;
+    return false;
+  }
+  return take_sample(a, h, byte_count);
+}
+
+// Moves the `Sample` of the region that was at `old` to `h`, where
+// `remap_region` or `remap_chunk` moved the region (`Header`, `sampled_flag`,
+// and all). Must be called with `a->lock` held.
+static void move_sample(Arena* a, const Header* old, Header* h) {
+  for (Sample** link = get_sample_bucket(a, old); *link != NULL;
+       link = &((*link)->next)) {
+    Sample* s = *link;
+    if (s->region == old) {
+      *link = s->next;
+      s->region = h;
+      Sample** bucket = get_sample_bucket(a, h);
+      s->next = *bucket;
+      *bucket = s;
+      return;
+    }
+  }
+}
+
+// Returns true if releasing `mark` frees the region that `s` sampled: if it
+// was sampled after the mark, and either bump-allocated (see `arena_mark`) or
+// given a mapping after the mark. Must be called with `a->lock` held.
+static bool is_released(const Arena* a, const Sample* s,
+                        const ArenaMark* mark) {
+  if (s->serial < mark->sample_serial) {
+    return false;
+  }
+  Header* h = s->region;
+  if (has_flag(h, mapped_flag)) {
+    return get_mapping(h)->serial >= mark->mapping_serial;
+  }
+  return a->region || has_flag(h, scoped_flag);
+}
+
+// Forgets the `Sample`s of the regions that releasing `mark` frees, or of all
+// regions if `mark` is `NULL`. Must be called with `a->lock` held, before the
+// regions are reused.
+static void forget_samples(Arena* a, const ArenaMark* mark) {
+  if (a->samples == NULL ||
+      (mark != NULL && a->next_sample_serial == mark->sample_serial)) {
+    return;
+  }
+  const size_t bucket_count = page_size / sizeof(Sample*);
+  for (size_t i = 0; i < bucket_count; i++) {
+    for (Sample** link = &(a->samples[i]); *link != NULL;) {
+      Sample* s = *link;
+      if (mark == NULL || is_released(a, s, mark)) {
+        *link = s->next;
+        put_sample_record(a, s);
+      } else {
+        link = &(s->next);
+      }
+    }
+  }
+}
+
+// Allocating decays the arena, too (see `ArenaOptions.decay_milliseconds`), so
+// that an arena that stops freeing still gives back what it freed before.
+static bool is_decay_due(Arena* a);
+static void decay(Arena* a);
+
+// Returns a region of exactly `unit_count` units, from the calling thread’s
+// cache if possible, or at least `unit_count` units if it is large enough to
+// get a mapping of its own. Sets `*zeroed` if the region’s bytes are known to
+// be 0, and clears its `zeroed_flag`.
+//
+// Returns `NULL` and sets `errno` if there was an error.
+static Header* malloc_internal(Arena* a, size_t unit_count, bool* zeroed) {
+  *zeroed = false;
+  if (unit_count > a->mapped_units) {
+    // Mappings have no neighbors, so we need no lock to change the `Header`.
+    Header* p = map_region(a, unit_count, sizeof(Header));
+    if (p != NULL) {
+      *zeroed = true;
+      clear_flag(p, zeroed_flag);
+    }
+    return p;
+  }
+  if (a->use_thread_cache && unit_count < exact_bin_count) {
+    Header* p = take_from_thread_cache(a, unit_count);
+    if (p != NULL) {
+      return p;
+    }
+  }
+
+  lock(&(a->lock));
+  free_remote_frees(a);
+  Header* p = allocate_units(a, unit_count);
+  if (p != NULL) {
+    *zeroed = has_flag(p, zeroed_flag);
+    clear_flag(p, zeroed_flag);
+    stats_add(&(a->stats.allocation_count), 1);
+  }
+  const bool decay_due = !a->region && is_decay_due(a);
+  unlock(&(a->lock));
+  if (decay_due) {
+    decay(a);
+  }
+  return p;
+}
+
+void* arena_malloc(Arena* a, size_t count, size_t size) {
+  const size_t unit_count = get_unit_count(count, size);
+  if (unit_count == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  bool zeroed;
+  Header* p = malloc_internal(a, unit_count, &zeroed);
+  if (p == NULL) {
+    return NULL;
+  }
+  count_sample_bytes(a, p, count * size);
+  return p + 1;
+}
+
+void* arena_calloc(Arena* a, size_t count, size_t size) {
+  const size_t unit_count = get_unit_count(count, size);
+  if (unit_count == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  bool zeroed;
+  Header* p = malloc_internal(a, unit_count, &zeroed);
+  if (p == NULL) {
+    return NULL;
+  }
+  if (!zeroed) {
+    zero_region(p + 1, (unit_count - 1) * sizeof(Header));
+  }
+  count_sample_bytes(a, p, count * size);
+  return p + 1;
+}
+
+void* arena_aligned_malloc(Arena* a, size_t alignment, size_t count,
+                           size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (alignment <= sizeof(Header)) {
+    return arena_malloc(a, count, size);
+  }
+  const size_t unit_count = get_unit_count(count, size);
+  if (unit_count == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (unit_count > a->mapped_units && alignment <= page_size) {
+    Header* h = map_region(a, unit_count, alignment);
+    if (h == NULL) {
+      return NULL;
+    }
+    clear_flag(h, zeroed_flag);
+    count_sample_bytes(a, h, count * size);
+    return h + 1;
+  }
+  bool zeroed;
+  Header* p = take_aligned(a, alignment, unit_count, &zeroed);
+  if (p == NULL) {
+    return NULL;
+  }
+  count_sample_bytes(a, p, count * size);
+  return p + 1;
+}
+
+// Returns an in-use region of `unit_count` units from `a`’s chunks (never a
+// mapping of its own), whose bytes start at a multiple of `alignment` (a power
+// of 2 greater than `sizeof(Header)`). Sets `*zeroed` if the region’s bytes are
+// known to be 0, and clears its `zeroed_flag`.
+//
+// Returns `NULL` and sets `errno` if there was an error.
+static Header* take_aligned(Arena* a, size_t alignment, size_t unit_count,
+                            bool* zeroed) {
+  const size_t alignment_units = alignment / sizeof(Header);
+  // We ask for 2 alignments more than we need, so that the leading remnant is
+  // never just 1 unit, which is too small to be a region of its own.
+  size_t padded_count;
+  if (mul(alignment_units, 2, &padded_count) ||
+      add(padded_count, unit_count, &padded_count) ||
+      padded_count > unit_count_mask) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  lock(&(a->lock));
+  Header* h = allocate_units(a, padded_count);
+  if (h == NULL) {
+    unlock(&(a->lock));
+    return NULL;
+  }
+
+  // Use the highest aligned address with room for `unit_count` units, which
+  // leaves at least `alignment_units + 1` units before it. The free list gives
+  // out the ends of free regions, so the slack then goes back where it came
+  // from and coalesces, rather than leaving a fragment after the region (and,
+  // for a child arena’s chunks, a gap between each chunk and the next).
+  const uintptr_t aligned =
+      (uintptr_t)(h + get_units(h) - unit_count + 1) & ~(alignment - 1);
+  Header* p = (Header*)aligned - 1;
+
+  // Give the leading and trailing slack back. Both remnants were part of `h`,
+  // so they inherit its `zeroed_flag`.
+  if (p != h) {
+    p->unit_count = (get_units(h) - (size_t)(p - h)) | in_use_flag |
+                    (h->unit_count & (zeroed_flag | scoped_flag));
+    set_units(h, (size_t)(p - h));
+    free_units(a, h);
+  }
+  if (get_units(p) - unit_count >= 2) {
+    free_units(a, split_in_use(p, unit_count));
+  }
+  *zeroed = has_flag(p, zeroed_flag);
+  clear_flag(p, zeroed_flag);
+  stats_add(&(a->stats.allocation_count), 1);
+  unlock(&(a->lock));
+  return p;
+}
+
+// Now that we have the chunk map, we can test to see whether `p` is actually
+// in a chunk of `a`. That is still not a perfect test that `p` is exactly a
+// pointer previously returned by `arena_malloc`, but it’s better than what we
+// started with.
+//
+// `abort`s if `p` is not inside 1 of `a`’s `Chunk`s, or if its region is not in
+// use (for example, because it has already been freed).
+static void check_free(Arena* a, void* p) {
+  const Chunk* c = find_chunk(p);
+  if (c == NULL || c->arena != a) {
+    abort();
+  }
+  const Header* h = (Header*)p - 1;
+  if (h < c->start || h >= c->start + get_chunk_units(c) ||
+      !has_flag(h, in_use_flag)) {
+    abort();
+  }
+}
+
+// Returns how many bytes of the free region `h` `arena_trim` could release: all
+// of its `Chunk`, if it is the only region in it, or else the bytes in the
+// whole pages inside it if it is large and not already released. Sets
+// `*whole_chunk` accordingly. Must be called with `a->lock` held.
+static size_t get_releasable_bytes(Arena* a, const Header* h,
+                                   Chunk*** whole_chunk) {
+  *whole_chunk = find_whole_chunk(a, h);
+  if (*whole_chunk != NULL) {
+    return (**whole_chunk)->byte_count;
+  }
+#if defined(__linux__)
+  // Only on Linux does `zero_region` release pages rather than write to them.
+  const size_t byte_count = (get_units(h) - 1) * sizeof(Header);
+  if (!has_flag(h, zeroed_flag) && byte_count >= madvise_zero_threshold) {
+    return byte_count - byte_count % page_size;
+  }
+#endif
+  return 0;
+}
+
+// Part of `collect_releasable_memory`: keeps the free region `h` if it became
+// free in `freed_before` or later, or if its releasable bytes fit in what is
+// left of `*keep_bytes`, and otherwise takes it off its list.
+static void collect_region(Arena* a, Header* h, size_t freed_before,
+                           size_t* keep_bytes, Chunk** chunks,
+                           Header** regions) {
+  if (get_free_epoch(h) >= freed_before) {
+    return;
+  }
+  Chunk** whole_chunk;
+  const size_t byte_count = get_releasable_bytes(a, h, &whole_chunk);
+  if (byte_count <= *keep_bytes) {
+    *keep_bytes -= byte_count;
+    return;
+  }
+  unlink_free_region(a, h);
+  if (whole_chunk != NULL) {
+    Chunk* c = *whole_chunk;
+    *whole_chunk = c->next;
+    c->next = *chunks;
+    *chunks = c;
+    stats_subtract(&(a->stats.in_use_units), get_units(h));
+    stats_subtract(&(a->stats.chunk_count), 1);
+    stats_subtract(&(a->stats.chunk_bytes), c->byte_count);
+  } else {
+    // Mark `h` as in use, so that nobody coalesces with it while it is off
+    // the lists.
+    set_flag(h, in_use_flag);
+    set_flag(get_next_region(h), previous_in_use_flag);
+    h->next = *regions;
+    *regions = h;
+  }
+}
+
+// Takes the `Chunk`s from `*link` to the end of its list, which must be
+// entirely free, off the list and onto `*chunks`, after the 1st `*keep_bytes`
+// of them. Must be called with `a->lock` held.
+static void collect_chunks(Arena* a, Chunk** link, size_t* keep_bytes,
+                           Chunk** chunks) {
+  while (*link != NULL) {
+    Chunk* c = *link;
+    if (c->byte_count <= *keep_bytes) {
+      *keep_bytes -= c->byte_count;
+      link = &(c->next);
+    } else {
+      *link = c->next;
+      c->next = *chunks;
+      *chunks = c;
+      stats_subtract(&(a->stats.chunk_count), 1);
+      stats_subtract(&(a->stats.chunk_bytes), c->byte_count);
+    }
+  }
+}
+
+// Takes releasable memory beyond the 1st `keep_bytes` off the free list (or
+// tree) and the bins: `Chunk`s that are entirely free go onto `*chunks` (and
+// off `a->chunk_list`), and other large free regions go onto `*regions`. The
+// caller must pass them to `release_memory`. Must be called with `a->lock`
+// held.
+//
+// Only free regions that became free before the `Arena.decay_epoch`
+// `freed_before` count; pass `SIZE_MAX` for all of them. The free chunks that
+// regions and marks leave behind record no epoch, so they count only then.
+static void collect_releasable_memory(Arena* a, size_t freed_before,
+                                      size_t keep_bytes, Chunk** chunks,
+                                      Header** regions) {
+  *chunks = NULL;
+  *regions = NULL;
+  if (add(keep_bytes, a->reserved_bytes, &keep_bytes)) {
+    keep_bytes = SIZE_MAX;
+  }
+  if (a->region) {
+    // The chunks after the current one are entirely free.
+    if (a->current_chunk != NULL && freed_before == SIZE_MAX) {
+      collect_chunks(a, &(a->current_chunk->next), &keep_bytes, chunks);
+    }
+    return;
+  }
+
+  // Taking a region off a list does not disturb the regions after it, so we
+  // can walk the lists as we go, as long as we count the circular free list.
+  // In the tree, we look up each region’s successor before taking it off.
+  for (Header* h = tree_first(a->free_tree); h != NULL;) {
+    Header* next = tree_next(a->free_tree, h);
+    collect_region(a, h, freed_before, &keep_bytes, chunks, regions);
+    h = next;
+  }
+  size_t count = 0;
+  Header* const start = a->free_list_start;
+  if (start != NULL) {
+    Header* h = start;
+    do {
+      count++;
+      h = h->next;
+    } while (h != start);
+  }
+  for (Header* h = start; count > 0; count--) {
+    Header* next = h->next;
+    collect_region(a, h, freed_before, &keep_bytes, chunks, regions);
+    h = next;
+  }
+  for (size_t i = 0; i < bin_count; i++) {
+    for (Header* h = a->bins[i]; h != NULL;) {
+      Header* next = h->next;
+      collect_region(a, h, freed_before, &keep_bytes, chunks, regions);
+      h = next;
+    }
+  }
+  // So are the chunks for marks after the current one (or all of them, if
+  // there are no marks).
+  if (freed_before == SIZE_MAX) {
+    collect_chunks(a,
+                   a->current_chunk != NULL ? &(a->current_chunk->next)
+                                            : &(a->scoped_chunks),
+                   &keep_bytes, chunks);
+  }
+}
+
+// Unmaps `chunks` and releases the pages of `regions`, and then puts `regions`
+// back onto the free list. Must be called without `a->lock` held.
+static void release_memory(Arena* a, Chunk* chunks, Header* regions) {
+  Chunk* last_chunk = NULL;
+  for (Chunk* c = chunks; c != NULL; c = c->next) {
+    release_chunk(c, false);
+    last_chunk = c;
+  }
+  if (chunks == NULL && regions == NULL) {
+    return;
+  }
+  for (Header* h = regions; h != NULL; h = h->next) {
+    zero_region(h + 1, (get_units(h) - 1) * sizeof(Header));
+  }
+  lock(&(a->lock));
+  if (last_chunk != NULL) {
+    last_chunk->next = a->free_chunks;
+    a->free_chunks = chunks;
+  }
+  for (Header* h = regions; h != NULL;) {
+    Header* next = h->next;
+    set_flag(h, zeroed_flag);
+    free_region(a, h);
+    h = next;
+  }
+  unlock(&(a->lock));
+}
+
+void arena_trim(Arena* a, size_t keep_bytes) {
+  Chunk* chunks;
+  Header* regions;
+  lock(&(a->lock));
+  free_remote_frees(a);
+  collect_releasable_memory(a, SIZE_MAX, keep_bytes, &chunks, &regions);
+  unlock(&(a->lock));
+  release_memory(a, chunks, regions);
+}
+
+bool arena_reserve(Arena* a, size_t byte_count, unsigned flags) {
+  if (byte_count == 0) {
+    return true;
+  }
+  size_t unit_count;
+  if (add(byte_count, sizeof(Header) - 1, &unit_count)) {
+    errno = EINVAL;
+    return false;
+  }
+  unit_count /= sizeof(Header);
+  lock(&(a->lock));
+  size_t reserved_byte_count;
+  if (a->region) {
+    // Make it the next chunk, as `advance_region` would.
+    Chunk* chunk = map_chunk(a, unit_count, flags);
+    if (chunk == NULL) {
+      unlock(&(a->lock));
+      return false;
+    }
+    Chunk* c = a->current_chunk;
+    Chunk** link = c != NULL ? &(c->next) : &(a->chunk_list);
+    chunk->next = *link;
+    *link = chunk;
+    reserved_byte_count = chunk->byte_count;
+  } else {
+    Header* h = get_more_memory(a, unit_count, flags);
+    if (h == NULL) {
+      unlock(&(a->lock));
+      return false;
+    }
+    reserved_byte_count = find_chunk(h)->byte_count;
+  }
+  if (add(a->reserved_bytes, reserved_byte_count, &(a->reserved_bytes))) {
+    a->reserved_bytes = SIZE_MAX;
+  }
+  unlock(&(a->lock));
+  return true;
+}
+
+// Returns true if it is time for `a` to decay. Must be called with `a->lock`
+// held.
+static bool is_decay_due(Arena* a) {
+  if (a->decay_nanoseconds == 0 ||
+      ++a->calls_since_decay_check < decay_check_interval) {
+    return false;
+  }
+  a->calls_since_decay_check = 0;
+  const int64_t now = GetMonotonicNanoseconds();
+  if (now < a->next_decay) {
+    return false;
+  }
+  // The 1st check only starts the clock.
+  const bool first = a->next_decay == 0;
+  a->next_decay = now + a->decay_nanoseconds;
+  return !first;
+}
+
+// Starts a new `Arena.decay_epoch`, and releases what `arena_trim` could
+// release from the free regions that became free at least 2 epochs ago. Epochs
+// are at least `Arena.decay_nanoseconds` long, so those regions have been idle
+// for at least that long. Must be called without `a->lock` held.
+static void decay(Arena* a) {
+  Chunk* chunks;
+  Header* regions;
+  lock(&(a->lock));
+  a->decay_epoch++;
+  collect_releasable_memory(a, a->decay_epoch - 1, 0, &chunks, &regions);
+  unlock(&(a->lock));
+  release_memory(a, chunks, regions);
+}
+
+void arena_free(Arena* a, void* p) {
+  Header* h = (Header*)p - 1;
+  if (has_flag(h, sampled_flag)) {
+    lock(&(a->lock));
+    forget_sample(a, h);
+    unlock(&(a->lock));
+  }
+  if (has_flag(h, mapped_flag)) {
+    unmap_region(a, h);
+    return;
+  }
+  if (a->region || has_flag(h, scoped_flag)) {
+    return;
+  }
+  assert(has_flag(h, in_use_flag));
+  scrub(h);
+  if (a->use_thread_cache && !do_check_free && put_in_thread_cache(a, h)) {
+    return;
+  }
+  if (a->use_remote_frees && !do_check_free &&
+      !pthread_equal(a->owner, pthread_self())) {
+    push_remote_free(a, h);
+    return;
+  }
+
+  lock(&(a->lock));
+  if (do_check_free) {
+    check_free(a, p);
+  }
+  free_remote_frees(a);
+  mark_scrubbed(h);
+  free_units(a, h);
+  stats_add(&(a->stats.free_count), 1);
+  const bool decay_due = is_decay_due(a);
+  unlock(&(a->lock));
+  if (decay_due) {
+    decay(a);
+  }
+}
+
+size_t arena_malloc_batch(Arena* a, size_t n, size_t size, void** out) {
+  const size_t unit_count = get_unit_count(1, size);
+  if (unit_count == 0) {
+    errno = EINVAL;
+    return 0;
+  }
+  if (unit_count > a->mapped_units) {
+    for (size_t i = 0; i < n; i++) {
+      Header* h = map_region(a, unit_count, sizeof(Header));
+      if (h == NULL) {
+        return i;
+      }
+      clear_flag(h, zeroed_flag);
+      out[i] = h + 1;
+      count_sample_bytes(a, h, size);
+    }
+    return n;
+  }
+
+  // We carve runs of regions out of single larger regions: 1 search per run,
+  // and the batch ends up together in memory. A run takes at most half a
+  // minimum-sized chunk, so that a large batch does not skip over free regions
+  // of reasonable size only to map a new chunk.
+  size_t run_limit = a->minimum_chunk_units / 2 / unit_count;
+  size_t i = 0;
+  lock(&(a->lock));
+  if (a->region || a->mark_depth != 0 || run_limit == 0) {
+    run_limit = 1;
+  }
+  free_remote_frees(a);
+  while (i < n) {
+    const size_t run = n - i < run_limit ? n - i : run_limit;
+    Header* h = allocate_units(a, run * unit_count);
+    if (h == NULL) {
+      break;
+    }
+    for (size_t j = 1; j < run; j++) {
+      Header* tail = split_in_use(h, unit_count);
+      clear_flag(h, zeroed_flag);
+      out[i++] = h + 1;
+      h = tail;
+    }
+    clear_flag(h, zeroed_flag);
+    out[i++] = h + 1;
+  }
+  stats_add(&(a->stats.allocation_count), i);
+  unlock(&(a->lock));
+  if (a->sample_bytes != 0) {
+    for (size_t j = 0; j < i; j++) {
+      count_sample_bytes(a, (Header*)out[j] - 1, size);
+    }
+  }
+  return i;
+}
+
+void arena_free_batch(Arena* a, size_t n, void** ptrs) {
+  for (size_t i = 0; i < n; i++) {
+    Header* h = (Header*)ptrs[i] - 1;
+    if (!has_flag(h, mapped_flag) && !a->region &&
+        !has_flag(h, scoped_flag)) {
+      assert(has_flag(h, in_use_flag));
+      scrub(h);
+    }
+  }
+
+  // Regions with mappings of their own are unlinked here, and unmapped after
+  // we release the lock.
+  Mapping* unmapped = NULL;
+  size_t free_count = 0;
+  lock(&(a->lock));
+  free_remote_frees(a);
+  for (size_t i = 0; i < n;) {
+    Header* h = (Header*)ptrs[i++] - 1;
+    if (has_flag(h, sampled_flag)) {
+      forget_sample(a, h);
+    }
+    if (has_flag(h, mapped_flag)) {
+      Mapping* m = get_mapping(h);
+      unlink_mapping(a, m);
+      m->next = unmapped;
+      unmapped = m;
+      free_count++;
+      continue;
+    }
+    if (a->region || has_flag(h, scoped_flag)) {
+      continue;
+    }
+    free_count++;
+    if (do_check_free) {
+      check_free(a, h + 1);
+    }
+    mark_scrubbed(h);
+    // Join `h` with the regions that follow it both in `ptrs` and in memory
+    // (as a batch from `arena_malloc_batch` does), so that we coalesce with
+    // the free neighbors, and link into a bin or the free list, only once for
+    // the whole run.
+    while (i < n && (Header*)ptrs[i] - 1 == get_next_region(h)) {
+      if (do_check_free) {
+        check_free(a, ptrs[i]);
+      }
+      Header* next = (Header*)ptrs[i++] - 1;
+      if (has_flag(next, sampled_flag)) {
+        forget_sample(a, next);
+      }
+      mark_scrubbed(next);
+      join(h, next);
+      free_count++;
+    }
+    free_region(a, h);
+  }
+  stats_add(&(a->stats.free_count), free_count);
+  const bool decay_due = !a->region && is_decay_due(a);
+  unlock(&(a->lock));
+
+  unmap_all(unmapped);
+  if (decay_due) {
+    decay(a);
+  }
+}
+
+// Shrinks the in-use region `h` to `unit_count` units, putting the rest back
+// onto the free list. Must be called with `a->lock` held.
+static void shrink_in_place(Arena* a, Header* h, size_t unit_count) {
+  Header* tail = split_in_use(h, unit_count);
+  scrub(tail);
+  mark_scrubbed(tail);
+  free_units(a, tail);
+}
+
+// Grows the in-use region `h` to `unit_count` units by absorbing the region
+// that follows it, if that region is free and large enough. Returns true if it
+// did. Must be called with `a->lock` held.
+static bool grow_in_place(Arena* a, Header* h, size_t unit_count) {
+  Header* const next = get_next_region(h);
+  if (has_flag(next, in_use_flag)) {
+    return false;
+  }
+  const size_t available = get_units(h) + get_units(next);
+  if (available < unit_count) {
+    return false;
+  }
+
+  const size_t epoch = get_free_epoch(next);
+  unlink_free_region(a, next);
+  if (available - unit_count >= 2) {
+    // The rest of `next` stays free, and as idle as it was.
+    Header* rest = h + unit_count;
+    rest->unit_count = (available - unit_count) | previous_in_use_flag |
+                       (next->unit_count & zeroed_flag);
+    set_units(h, unit_count);
+    link_free_region(a, rest, epoch);
+  } else {
+    set_units(h, available);
+    set_flag(get_next_region(h), previous_in_use_flag);
+  }
+  return true;
+}
+
+// If the in-use region `h` is the only region in its `Chunk`, asks the
+// platform to resize the chunk so that `h` holds at least `unit_count` units.
+// The platform can usually do this by changing page mappings, without copying.
+// Returns the new `Header` for the region, or `NULL` if `h` cannot be
+// remapped. Must be called with `a->lock` held, but releases it while waiting
+// for the platform.
+static Header* remap_chunk(Arena* a, Header* h, size_t unit_count) {
+#if defined(__linux__)
+  // `mremap` would not keep huge-page chunks aligned, and must not move a
+  // parent’s memory.
+  if (a->use_huge_pages || a->parent != NULL ||
+      get_units(h) < a->minimum_chunk_units) {
+    return NULL;
+  }
+  Chunk** link = find_whole_chunk(a, h);
+  if (link == NULL) {
+    return NULL;
+  }
+  Chunk* chunk = *link;
+  size_t byte_count;
+  if (mul(unit_count, sizeof(Header), &byte_count) ||
+      add(byte_count, sizeof(Header) + page_size - 1, &byte_count)) {
+    return NULL;
+  }
+  byte_count -= byte_count % page_size;
+
+  // Nobody else can be using `chunk`, so we only need the lock to unlink it
+  // and link it back in.
+  *link = chunk->next;
+  const size_t old_byte_count = chunk->byte_count;
+  const size_t old_unit_count = get_units(h);
+  const bool sampled = has_flag(h, sampled_flag);
+  unlock(&(a->lock));
+
+  // The chunk map must cover the new address range before the chunk moves
+  // there, so we choose it ourselves: we reserve it, add it to the map, and
+  // then have `mremap` move the chunk on top of the reservation.
+  void* target = mmap(NULL, byte_count, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      0, 0);
+  void* remapped = MAP_FAILED;
+  if (target != MAP_FAILED) {
+    if (set_chunk_map(target, byte_count, chunk)) {
+      set_chunk_map(chunk->start, old_byte_count, NULL);
+      remapped = mremap(chunk->start, old_byte_count, byte_count,
+                        MREMAP_MAYMOVE | MREMAP_FIXED, target);
+      if (remapped == MAP_FAILED) {
+        set_chunk_map(chunk->start, old_byte_count, chunk);
+        set_chunk_map(target, byte_count, NULL);
+      }
+    }
+    if (remapped == MAP_FAILED && munmap(target, byte_count)) {
+      abort();
+    }
+  }
+  lock(&(a->lock));
+  if (remapped == MAP_FAILED) {
+    prepend_chunk(a, chunk, old_byte_count);
+    return NULL;
+  }
+  chunk->start = remapped;
+  stats_add(&(a->stats.chunk_bytes), byte_count - old_byte_count);
+  stats_subtract(&(a->stats.in_use_units), old_unit_count);
+  prepend_chunk(a, chunk, byte_count);
+  // The region keeps its sample, if it has 1 (see `arena_realloc`).
+  Header* region = format_chunk(a, chunk);
+  if (sampled) {
+    set_flag(region, sampled_flag);
+  }
+  return region;
+#else
+  (void)a;
+  (void)h;
+  (void)unit_count;
+  return NULL;
+#endif
+}
+
+// Moves the contents of the in-use region `p` to a new region of `count * size`
+// bytes, and frees `p`.
+static void* move_region(Arena* a, void* p, size_t count, size_t size) {
+  bool zeroed;
+  Header* h = malloc_internal(a, get_unit_count(count, size), &zeroed);
+  if (h == NULL) {
+    return NULL;
+  }
+  void* q = h + 1;
+  // `resize_region` has checked that this does not overflow.
+  const size_t new_byte_count = count * size;
+  const size_t old_byte_count =
+      (get_units((Header*)p - 1) - 1) * sizeof(Header);
+  memcpy(q, p,
+         old_byte_count < new_byte_count ? old_byte_count : new_byte_count);
+  arena_free(a, p);
+  return q;
+}
+
+// Does the work of `arena_realloc` for the region `p`, but leaves the profiler
+// (see `ArenaOptions.sample_bytes`) to it.
+static void* resize_region(Arena* a, void* p, size_t count, size_t size) {
+  const size_t unit_count = get_unit_count(count, size);
+  if (unit_count == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  Header* h = (Header*)p - 1;
+  if (has_flag(h, mapped_flag)) {
+    // Small enough regions move back to the free list.
+    if (unit_count > a->mapped_units) {
+      Header* remapped = remap_region(a, h, unit_count);
+      if (remapped != NULL) {
+        return remapped + 1;
+      }
+    }
+    return move_region(a, p, count, size);
+  }
+
+  if (a->region || has_flag(h, scoped_flag)) {
+    if (unit_count <= get_units(h)) {
+      return p;
+    }
+    // If `h` is the most recent allocation, it can grow into the rest of the
+    // current chunk — unless it is from before the most recent mark, which
+    // would then rewind into the middle of it.
+    lock(&(a->lock));
+    const bool grown = h + get_units(h) == a->region_next &&
+                       (size_t)(a->region_end - h) >= unit_count &&
+                       (a->current_chunk != a->mark_chunk || h >= a->mark_next);
+    if (grown) {
+      a->scoped_units += unit_count - get_units(h);
+      stats_add(&(a->stats.in_use_units), unit_count - get_units(h));
+      a->region_next = h + unit_count;
+      set_units(h, unit_count);
+    }
+    unlock(&(a->lock));
+    return grown ? p : move_region(a, p, count, size);
+  }
+
+  if (unit_count <= get_units(h)) {
+    // Leftovers too small to be allocated again stay with the region.
+    if (get_units(h) - unit_count >= 2) {
+      lock(&(a->lock));
+      shrink_in_place(a, h, unit_count);
+      unlock(&(a->lock));
+    }
+    return p;
+  }
+
+  lock(&(a->lock));
+  if (grow_in_place(a, h, unit_count)) {
+    unlock(&(a->lock));
+    return p;
+  }
+  Header* remapped = remap_chunk(a, h, unit_count);
+  unlock(&(a->lock));
+  if (remapped != NULL) {
+    return remapped + 1;
+  }
+
+  return move_region(a, p, count, size);
+}
+
+// The profiler treats the resized region as a new allocation: it forgets the
+// old region’s sample, if it had 1, and counts the new size toward the next.
+// It does so only once the resize has succeeded, since a failed 1 leaves the
+// region as it was.
+void* arena_realloc(Arena* a, void* p, size_t count, size_t size) {
+  if (p == NULL) {
+    return arena_malloc(a, count, size);
+  }
+  Header* h = (Header*)p - 1;
+  void* q = resize_region(a, p, count, size);
+  if (q == NULL) {
+    return NULL;
+  }
+  // A region that `move_region` copied is new, and freeing `p` forgot its
+  // sample. A remapped region keeps its `sampled_flag`, but its `Sample` still
+  // has the old address. A region resized in place gets a new sample in place
+  // of the old (see `take_sample`), or loses the old 1 here.
+  Header* resized = (Header*)q - 1;
+  if (resized != h && has_flag(resized, sampled_flag)) {
+    lock(&(a->lock));
+    move_sample(a, h, resized);
+    unlock(&(a->lock));
+  }
+  if (!count_sample_bytes(a, resized, count * size) &&
+      has_flag(resized, sampled_flag)) {
+    lock(&(a->lock));
+    forget_sample(a, resized);
+    unlock(&(a->lock));
+  }
+  return q;
+}
+
+size_t arena_get_usable_size(const void* p) {
+  const Header* h = (const Header*)p - 1;
+  return (get_units(h) - 1) * sizeof(Header);
+}
+
+Arena* arena_get_owner(const void* p) {
+  const Header* h = (const Header*)p - 1;
+  if (has_flag(h, mapped_flag)) {
+    return ((const Mapping*)h - 1)->arena;
+  }
+  // Look up `p` rather than `h`: a region’s `Header` can share a page with the
+  // end of a child arena’s chunk (see `get_chunk_memory`).
+  const Chunk* c = find_chunk(p);
+  return c != NULL ? c->arena : NULL;
+}
+
+void arena_prepare_fork(Arena* a) {
+  lock(&(a->lock));
+}
+
+void arena_parent_after_fork(Arena* a) {
+  unlock(&(a->lock));
+}
+
+void arena_child_after_fork(Arena* a) {
+  // The child has only the thread that forked, which holds the lock. Other
+  // threads may have been waiting for it, though, and (with
+  // `arena_lock_ticket`) have taken tickets that nobody will ever use, so we
+  // start the lock over rather than release it.
+  lock_create(&(a->lock), a->lock.kind);
+}
+
+static size_t stats_get(const atomic_size_t* c) {
+  return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+void arena_get_stats(const Arena* a, ArenaStats* stats) {
+  const Stats* s = &(a->stats);
+  stats->allocation_count = stats_get(&(s->allocation_count));
+  stats->free_count = stats_get(&(s->free_count));
+  stats->in_use_bytes = stats_get(&(s->in_use_units)) * sizeof(Header);
+  stats->free_bytes = stats_get(&(s->free_units)) * sizeof(Header);
+  stats->free_region_count = stats_get(&(s->free_region_count));
+  stats->chunk_count = stats_get(&(s->chunk_count));
+  stats->chunk_bytes = stats_get(&(s->chunk_bytes));
+  stats->mapping_count = stats_get(&(s->mapping_count));
+  stats->mapping_bytes = stats_get(&(s->mapping_bytes));
+  stats->chunk_map_count = stats_get(&(s->chunk_map_count));
+  stats->chunk_reuse_count = stats_get(&(s->chunk_reuse_count));
+  for (size_t i = 0; i < arena_search_step_bucket_count; i++) {
+    stats->search_steps[i] = stats_get(&(s->search_steps[i]));
+  }
+  stats->lock_contention_count = stats_get(&(a->lock.contention_count));
+  stats->lock_spin_count = stats_get(&(a->lock.spin_count));
+  stats->remote_free_count = stats_get(&(s->remote_free_count));
+  stats->sample_count = stats_get(&(s->sample_count));
+}
+
+void arena_reset(Arena* a) {
+  destroy_children(a);
+  lock(&(a->lock));
+  while (a->thread_caches != NULL) {
+    detach_thread_cache(a->thread_caches);
+  }
+  forget_samples(a, NULL);
+  Mapping* mappings = a->mappings;
+  a->mappings = NULL;
+  atomic_store_explicit(&(a->remote_frees), NULL, memory_order_relaxed);
+  memset(a->bins, 0, sizeof(a->bins));
+  a->bin_map = 0;
+  atomic_store_explicit(&(a->stats.in_use_units), 0, memory_order_relaxed);
+  atomic_store_explicit(&(a->stats.free_units), 0, memory_order_relaxed);
+  atomic_store_explicit(&(a->stats.free_region_count), 0,
+                        memory_order_relaxed);
+  atomic_store_explicit(&(a->stats.mapping_count), 0, memory_order_relaxed);
+  atomic_store_explicit(&(a->stats.mapping_bytes), 0, memory_order_relaxed);
+  a->mark_depth = 0;
+  a->scoped_units = 0;
+  a->mark_chunk = NULL;
+  a->mark_next = NULL;
+  if (a->region) {
+    if (a->chunk_list != NULL) {
+      enter_region_chunk(a, a->chunk_list);
+    }
+  } else {
+    // Each chunk becomes 1 free region again, and the chunks for marks wait for
+    // the next mark.
+    a->free_list_start = NULL;
+    a->free_tree = NULL;
+    for (Chunk* c = a->chunk_list; c != NULL; c = c->next) {
+      free_region(a, format_chunk(a, c));
+    }
+    leave_region_chunk(a);
+    a->current_chunk = NULL;
+    a->region_next = a->region_end = a->region_clean = NULL;
+  }
+  unlock(&(a->lock));
+
+  unmap_all(mappings);
+}
+
+bool arena_mark(Arena* a, ArenaMark* mark) {
+  if (a->use_thread_cache) {
+    // The caches would hand out regions from before the mark, which releasing
+    // it could not reclaim.
+    errno = EINVAL;
+    return false;
+  }
+  lock(&(a->lock));
+  if (a->children != NULL) {
+    // Releasing the mark would take back the children’s chunks.
+    unlock(&(a->lock));
+    errno = EBUSY;
+    return false;
+  }
+  mark->chunk = a->current_chunk;
+  mark->next = a->region_next;
+  mark->scoped_units = a->scoped_units;
+  mark->mapping_serial = a->next_mapping_serial;
+  mark->sample_serial = a->next_sample_serial;
+  mark->depth = a->mark_depth++;
+  a->mark_chunk = a->current_chunk;
+  a->mark_next = a->region_next;
+  unlock(&(a->lock));
+  return true;
+}
+
+void arena_release_to_mark(Arena* a, const ArenaMark* mark) {
+  lock(&(a->lock));
+  forget_samples(a, mark);
+  leave_region_chunk(a);
+  if (mark->chunk != NULL) {
+    enter_region_chunk(a, mark->chunk);
+    a->region_next = mark->next;
+  } else {
+    a->current_chunk = NULL;
+    a->region_next = a->region_end = a->region_clean = NULL;
+  }
+  stats_subtract(&(a->stats.in_use_units),
+                 a->scoped_units - mark->scoped_units);
+  a->scoped_units = mark->scoped_units;
+  a->mark_depth = mark->depth;
+  // We no longer know where the enclosing mark is, so we conservatively treat
+  // this one as the most recent. With no marks left, nothing can rewind.
+  a->mark_chunk = a->mark_depth != 0 ? mark->chunk : NULL;
+  a->mark_next = a->mark_depth != 0 ? mark->next : NULL;
+
+  // Mappings made since the mark are unlinked here, and unmapped after we
+  // release the lock.
+  Mapping* unmapped = NULL;
+  for (Mapping* m = a->mappings; m != NULL;) {
+    Mapping* next = m->next;
+    if (m->serial >= mark->mapping_serial) {
+      unlink_mapping(a, m);
+      m->next = unmapped;
+      unmapped = m;
+    }
+    m = next;
+  }
+  unlock(&(a->lock));
+
+  unmap_all(unmapped);
+}
+
+// Copies of samples for `arena_write_profile`, in memory mapped for the
+// purpose, so that writing a profile does not call `malloc` (or hold the
+// arena’s lock while it waits for the file).
+typedef struct SampleSnapshot {
+  Sample* samples;
+  size_t count;
+  size_t capacity;
+} SampleSnapshot;
+
+static void free_snapshot(SampleSnapshot* snapshot) {
+  if (snapshot->capacity != 0 &&
+      munmap(snapshot->samples, snapshot->capacity * sizeof(Sample))) {
+    abort();
+  }
+}
+
+// Appends copies of `a`’s samples to `snapshot`, growing it as necessary.
+//
+// Returns false and sets `errno` if there was an error.
+static bool copy_samples(Arena* a, SampleSnapshot* snapshot) {
+  lock(&(a->lock));
+  while (snapshot->count + stats_get(&(a->stats.sample_count)) >
+         snapshot->capacity) {
+    const size_t capacity =
+        2 * (snapshot->count + stats_get(&(a->stats.sample_count)));
+    unlock(&(a->lock));
+    Sample* samples = mmap(NULL, capacity * sizeof(Sample),
+                           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                           0, 0);
+    if (samples == MAP_FAILED) {
+      return false;
+    }
+    if (snapshot->count != 0) {
+      memcpy(samples, snapshot->samples, snapshot->count * sizeof(Sample));
+    }
+    free_snapshot(snapshot);
+    snapshot->samples = samples;
+    snapshot->capacity = capacity;
+    lock(&(a->lock));
+  }
+  if (a->samples != NULL) {
+    const size_t bucket_count = page_size / sizeof(Sample*);
+    for (size_t i = 0; i < bucket_count; i++) {
+      for (const Sample* s = a->samples[i]; s != NULL; s = s->next) {
+        snapshot->samples[snapshot->count++] = *s;
+      }
+    }
+  }
+  unlock(&(a->lock));
+  return true;
+}
+
+// Appends `n` to `line` at `*length`, in decimal, or in hexadecimal with a
+// leading "0x" if `base` is 16. We format by hand, because `snprintf` might
+// call `malloc`.
+static void append_number(char* line, size_t* length, uint64_t n,
+                          unsigned base) {
+  char digits[20];
+  size_t digit_count = 0;
+  do {
+    digits[digit_count++] = "0123456789abcdef"[n % base];
+    n /= base;
+  } while (n != 0);
+  if (base == 16) {
+    line[(*length)++] = '0';
+    line[(*length)++] = 'x';
+  }
+  while (digit_count != 0) {
+    line[(*length)++] = digits[--digit_count];
+  }
+}
+
+static void append_string(char* line, size_t* length, const char* s) {
+  const size_t n = strlen(s);
+  memcpy(line + *length, s, n);
+  *length += n;
+}
+
+// Returns false and sets `errno` if there was an error.
+static bool write_all(int fd, const char* p, size_t byte_count) {
+  while (byte_count != 0) {
+    const ssize_t written = write(fd, p, byte_count);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    p += written;
+    byte_count -= (size_t)written;
+  }
+  return true;
+}
+
+// Appends "count: bytes [count: bytes] @" to `line`, where the 2nd pair (the
+// total allocated) is the same as the 1st (the total in use), because we keep
+// only the live samples.
+static void append_counts(char* line, size_t* length, size_t count,
+                          size_t byte_count) {
+  for (int i = 0; i < 2; i++) {
+    append_string(line, length, i == 0 ? "" : " [");
+    append_number(line, length, count, 10);
+    append_string(line, length, ": ");
+    append_number(line, length, byte_count, 10);
+    append_string(line, length, i == 0 ? "" : "]");
+  }
+  append_string(line, length, " @");
+}
+
+// Long enough for the counts and `sample_frame_count` return addresses.
+enum { profile_line_size = 128 + sample_frame_count * 20 };
+
+// Writes `snapshot` to `fd` as a gperftools heap profile, with `sample_bytes`
+// as the sampling interval, followed (on Linux) by the process’ memory map.
+//
+// Returns false and sets `errno` if there was an error.
+static bool write_profile(const SampleSnapshot* snapshot, size_t sample_bytes,
+                          int fd) {
+  size_t total_bytes = 0;
+  for (size_t i = 0; i < snapshot->count; i++) {
+    total_bytes += snapshot->samples[i].byte_count;
+  }
+  char line[profile_line_size];
+  size_t length = 0;
+  append_string(line, &length, "heap profile: ");
+  append_counts(line, &length, snapshot->count, total_bytes);
+  append_string(line, &length, " heap_v2/");
+  append_number(line, &length, sample_bytes, 10);
+  append_string(line, &length, "\n");
+  if (!write_all(fd, line, length)) {
+    return false;
+  }
+  for (size_t i = 0; i < snapshot->count; i++) {
+    const Sample* s = &(snapshot->samples[i]);
+    length = 0;
+    append_counts(line, &length, 1, s->byte_count);
+    for (size_t j = 0; j < s->frame_count; j++) {
+      append_string(line, &length, " ");
+      append_number(line, &length, (uintptr_t)s->frames[j], 16);
+    }
+    append_string(line, &length, "\n");
+    if (!write_all(fd, line, length)) {
+      return false;
+    }
+  }
+
+#if defined(__linux__)
+  const int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (maps < 0) {
+    return true;
+  }
+  bool ok = write_all(fd, "\nMAPPED_LIBRARIES:\n", 19);
+  while (ok) {
+    const ssize_t n = read(maps, line, sizeof(line));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      ok = n == 0;
+      break;
+    }
+    ok = write_all(fd, line, (size_t)n);
+  }
+  const int e = errno;
+  close(maps);
+  errno = e;
+  return ok;
+#else
+  return true;
+#endif
+}
+
+bool arena_write_profile(Arena* a, int fd) {
+  SampleSnapshot snapshot = {0};
+  const bool ok = copy_samples(a, &snapshot) &&
+                  write_profile(&snapshot, a->sample_bytes, fd);
+  const int e = errno;
+  free_snapshot(&snapshot);
+  errno = e;
+  return ok;
+}
+
+void arena_destroy(Arena* a) {
+  destroy_children(a);
+  lock(&(a->lock));
+  while (a->thread_caches != NULL) {
+    detach_thread_cache(a->thread_caches);
+  }
+  for (Chunk* c = a->chunk_list; c != NULL; c = c->next) {
+    release_chunk(c, true);
+  }
+  for (Chunk* c = a->scoped_chunks; c != NULL; c = c->next) {
+    release_chunk(c, true);
+  }
+  for (ChunkSlab* s = a->chunk_slabs; s != NULL;) {
+    ChunkSlab* next = s->next;
+    put_chunk_slab(s);
+    s = next;
+  }
+  for (SampleSlab* s = a->sample_slabs; s != NULL;) {
+    SampleSlab* next = s->next;
+    if (munmap(s, page_size)) {
+      abort();
+    }
+    s = next;
+  }
+  if (a->samples != NULL && munmap(a->samples, page_size)) {
+    abort();
+  }
+  unmap_all(a->mappings);
+  a->chunk_list = NULL;
+  a->chunk_slabs = NULL;
+  a->free_chunks = NULL;
+  a->mappings = NULL;
+  a->current_chunk = NULL;
+  a->region_next = a->region_end = a->region_clean = NULL;
+  a->free_list_start = NULL;
+  a->free_tree = NULL;
+  memset(a->bins, 0, sizeof(a->bins));
+  a->bin_map = 0;
+  a->reserved_bytes = 0;
+  a->mark_depth = 0;
+  a->scoped_chunks = NULL;
+  a->scoped_units = 0;
+  a->mark_chunk = NULL;
+  a->mark_next = NULL;
+  a->samples = NULL;
+  a->free_samples = NULL;
+  a->sample_slabs = NULL;
+  atomic_store_explicit(&(a->remote_frees), NULL, memory_order_relaxed);
+  memset(&(a->stats), 0, sizeof(a->stats));
+  unlock(&(a->lock));
+  leave_parent(a);
+}
+
+// Pools get slabs of at least this many bytes from their parent arenas, and
+// large enough for at least `pool_minimum_slab_objects` objects. Slabs this
+// size come from the parent’s bins, and amortize the parent’s lock and search
+// over hundreds of small objects.
+static const size_t pool_slab_byte_count = (size_t)1 << 16;
+static const size_t pool_minimum_slab_objects = 8;
+
+bool arena_pool_create(ArenaPool* p, Arena* parent, size_t object_size,
+                       size_t alignment) {
+  if (object_size == 0 || alignment == 0 ||
+      (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return false;
+  }
+  // Free objects hold the free list’s links.
+  if (alignment < _Alignof(void*)) {
+    alignment = _Alignof(void*);
+  }
+  if (object_size < sizeof(void*)) {
+    object_size = sizeof(void*);
+  }
+  size_t slab_byte_count;
+  if (add(object_size, alignment - 1, &object_size) ||
+      mul(object_size & ~(alignment - 1), pool_minimum_slab_objects,
+          &slab_byte_count) ||
+      add(slab_byte_count, alignment, &slab_byte_count)) {
+    errno = EINVAL;
+    return false;
+  }
+
+  lock_create(&(p->lock), parent->lock.kind);
+  p->parent = parent;
+  p->object_size = object_size & ~(alignment - 1);
+  p->alignment = alignment;
+  p->slab_byte_count = slab_byte_count > pool_slab_byte_count
+                           ? slab_byte_count
+                           : pool_slab_byte_count;
+  p->slab_header_size = (sizeof(Slab) + alignment - 1) & ~(alignment - 1);
+  p->slabs = NULL;
+  p->free_list = NULL;
+  p->fresh_next = p->fresh_end = NULL;
+  return true;
+}
+
+// Gets a new slab from `p->parent`, and makes its objects the fresh ones. Must
+// be called with `p->lock` held.
+//
+// Returns false and sets `errno` if there was an error.
+static bool add_slab(ArenaPool* p) {
+  Slab* s =
+      arena_aligned_malloc(p->parent, p->alignment, 1, p->slab_byte_count);
+  if (s == NULL) {
+    return false;
+  }
+  s->next = p->slabs;
+  p->slabs = s;
+  const size_t count =
+      (p->slab_byte_count - p->slab_header_size) / p->object_size;
+  p->fresh_next = (char*)s + p->slab_header_size;
+  p->fresh_end = p->fresh_next + count * p->object_size;
+  return true;
+}
+
+void* arena_pool_malloc(ArenaPool* p) {
+  lock(&(p->lock));
+  void* object = p->free_list;
+  if (object != NULL) {
+    p->free_list = *(void**)object;
+  } else {
+    if (p->fresh_next == p->fresh_end && !add_slab(p)) {
+      unlock(&(p->lock));
+      return NULL;
+    }
+    object = p->fresh_next;
+    p->fresh_next += p->object_size;
+  }
+  unlock(&(p->lock));
+  return object;
+}
+
+void arena_pool_free(ArenaPool* p, void* object) {
+  if (overwrite_on_free) {
+    memset(object, 0, p->object_size);
+  }
+  lock(&(p->lock));
+  *(void**)object = p->free_list;
+  p->free_list = object;
+  unlock(&(p->lock));
+}
+
+void arena_pool_destroy(ArenaPool* p) {
+  lock(&(p->lock));
+  for (Slab* s = p->slabs; s != NULL;) {
+    Slab* next = s->next;
+    arena_free(p->parent, s);
+    s = next;
+  }
+  p->slabs = NULL;
+  p->free_list = NULL;
+  p->fresh_next = p->fresh_end = NULL;
+  unlock(&(p->lock));
+}
+
+bool arena_set_create(ArenaSet* s, const ArenaOptions* options) {
+  const long cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+  s->arena_count = cpu_count > 0 ? (size_t)cpu_count : 1;
+  s->arenas = mmap(NULL, s->arena_count * sizeof(CPUArena),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+  if (s->arenas == MAP_FAILED) {
+    return false;
+  }
+  ArenaOptions o = *options;
+  o.remote_frees = false;
+  for (size_t i = 0; i < s->arena_count; i++) {
+    arena_create_with_options(&(s->arenas[i].arena), &o);
+    s->arenas[i].arena.in_set = true;
+  }
+  return true;
+}
+
+// Threads that cannot learn their CPU number (see `get_cpu_arena`) take the
+// next index from `next_fallback_index` the 1st time. 0 means not yet.
+static atomic_size_t next_fallback_index;
+static _Thread_local size_t fallback_index;
+
+// Returns the arena of the CPU that the calling thread is running on (or was,
+// a moment ago).
+static Arena* get_cpu_arena(ArenaSet* s) {
+#if defined(__linux__)
+  // With glibc 2.35 and later, this reads the CPU number from the thread’s
+  // restartable sequence area, without a system call.
+  const int cpu = sched_getcpu();
+  if (cpu >= 0) {
+    return &(s->arenas[(size_t)cpu % s->arena_count].arena);
+  }
+#endif
+  // Without CPU numbers, we spread threads over the arenas round-robin.
+  if (fallback_index == 0) {
+    fallback_index = atomic_fetch_add_explicit(&next_fallback_index, 1,
+                                               memory_order_relaxed) +
+                     1;
+  }
+  return &(s->arenas[fallback_index % s->arena_count].arena);
+}
+
+void* arena_set_malloc(ArenaSet* s, size_t count, size_t size) {
+  return arena_malloc(get_cpu_arena(s), count, size);
+}
+
+void* arena_set_calloc(ArenaSet* s, size_t count, size_t size) {
+  return arena_calloc(get_cpu_arena(s), count, size);
+}
+
+void* arena_set_aligned_malloc(ArenaSet* s, size_t alignment, size_t count,
+                               size_t size) {
+  return arena_aligned_malloc(get_cpu_arena(s), alignment, count, size);
+}
+
+// Returns the arena that `p` came from, which must be 1 of `s`’s.
+static Arena* get_set_owner(const ArenaSet* s, const void* p) {
+  Arena* a = arena_get_owner(p);
+  assert(a != NULL && (uintptr_t)a >= (uintptr_t)s->arenas &&
+         (uintptr_t)a < (uintptr_t)(s->arenas + s->arena_count));
+  (void)s;
+  return a;
+}
+
+void arena_set_free(ArenaSet* s, void* p) {
+  arena_free(get_set_owner(s, p), p);
+}
+
+void* arena_set_realloc(ArenaSet* s, void* p, size_t count, size_t size) {
+  if (p == NULL) {
+    return arena_set_malloc(s, count, size);
+  }
+  return arena_realloc(get_set_owner(s, p), p, count, size);
+}
+
+void arena_set_trim(ArenaSet* s, size_t keep_bytes) {
+  for (size_t i = 0; i < s->arena_count; i++) {
+    arena_trim(&(s->arenas[i].arena), keep_bytes);
+  }
+}
+
+void arena_set_get_stats(const ArenaSet* s, ArenaStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  for (size_t i = 0; i < s->arena_count; i++) {
+    ArenaStats t;
+    arena_get_stats(&(s->arenas[i].arena), &t);
+    stats->allocation_count += t.allocation_count;
+    stats->free_count += t.free_count;
+    stats->in_use_bytes += t.in_use_bytes;
+    stats->free_bytes += t.free_bytes;
+    stats->free_region_count += t.free_region_count;
+    stats->chunk_count += t.chunk_count;
+    stats->chunk_bytes += t.chunk_bytes;
+    stats->mapping_count += t.mapping_count;
+    stats->mapping_bytes += t.mapping_bytes;
+    stats->chunk_map_count += t.chunk_map_count;
+    stats->chunk_reuse_count += t.chunk_reuse_count;
+    for (size_t j = 0; j < arena_search_step_bucket_count; j++) {
+      stats->search_steps[j] += t.search_steps[j];
+    }
+    stats->lock_contention_count += t.lock_contention_count;
+    stats->lock_spin_count += t.lock_spin_count;
+    stats->remote_free_count += t.remote_free_count;
+    stats->sample_count += t.sample_count;
+  }
+}
+
+bool arena_set_write_profile(ArenaSet* s, int fd) {
+  SampleSnapshot snapshot = {0};
+  bool ok = true;
+  for (size_t i = 0; ok && i < s->arena_count; i++) {
+    ok = copy_samples(&(s->arenas[i].arena), &snapshot);
+  }
+  ok = ok && write_profile(&snapshot, s->arenas[0].arena.sample_bytes, fd);
+  const int e = errno;
+  free_snapshot(&snapshot);
+  errno = e;
+  return ok;
+}
+
+void arena_set_prepare_fork(ArenaSet* s) {
+  for (size_t i = 0; i < s->arena_count; i++) {
+    arena_prepare_fork(&(s->arenas[i].arena));
+  }
+}
+
+void arena_set_parent_after_fork(ArenaSet* s) {
+  for (size_t i = 0; i < s->arena_count; i++) {
+    arena_parent_after_fork(&(s->arenas[i].arena));
+  }
+}
+
+void arena_set_child_after_fork(ArenaSet* s) {
+  for (size_t i = 0; i < s->arena_count; i++) {
+    arena_child_after_fork(&(s->arenas[i].arena));
+  }
+}
+
+void arena_set_destroy(ArenaSet* s) {
+  for (size_t i = 0; i < s->arena_count; i++) {
+    arena_destroy(&(s->arenas[i].arena));
+  }
+  if (munmap(s->arenas, s->arena_count * sizeof(CPUArena))) {
+    abort();
+  }
+  s->arenas = NULL;
+  s->arena_count = 0;
 }
@@ -2,8 +2,11 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 // `Arena` is a metadata structure that describes a (set of) allocation
 // region(s). You can use 1 for the entire process, or 1 per thread, or 1 per
@@ -24,6 +27,144 @@ void arena_create(Arena* a, size_t minimum_chunk_units)
 // applications. It is tuned to be appropriate for the platform.
 extern const size_t default_minimum_chunk_units;
 
+// The kinds of lock that an `Arena` can use to protect itself.
+typedef enum ArenaLockKind {
+  // A mutex that spins briefly and then sleeps (on Linux, on a futex) until it
+  // is released. It is not fair: a running thread can take the lock ahead of
+  // threads that are asleep. That keeps throughput high when there are more
+  // runnable threads than CPUs, because the lock rarely has to wait for a
+  // sleeping thread to be scheduled.
+  arena_lock_mutex,
+
+  // A ticket lock, which grants the lock in FIFO order. Like
+  // `arena_lock_mutex`, waiters spin briefly and then sleep, and each release
+  // wakes (only) the next waiter. Fairness has a price when threads outnumber
+  // CPUs: every hand-off has to wait for the next thread to be scheduled.
+  arena_lock_ticket,
+
+  // A test-and-set spin lock. It is cheap when uncontended, but unfair, and
+  // waiters burn whole time slices if the holder is preempted.
+  arena_lock_spin,
+} ArenaLockKind;
+
+// How an `Arena` chooses among the free regions that are large enough for a
+// request. This applies to regions too large for the size-class bins; smaller
+// requests are served from the bins first, regardless.
+typedef enum ArenaFitPolicy {
+  // Take the 1st region that is large enough, resuming the search where the
+  // last one left off. Searches are short when most regions are large enough,
+  // but successive requests get spread over many regions.
+  arena_fit_next,
+
+  // Take the smallest region that is large enough and, among equals, the one
+  // at the lowest address (_address-ordered best fit_). The free regions form a
+  // balanced tree, so this takes O(log n) time. It tends to keep large regions
+  // intact and small objects packed together.
+  arena_fit_best,
+} ArenaFitPolicy;
+
+// Optional behaviors for `arena_create_with_options`. A zero-initialized
+// `ArenaOptions` gives the default behavior.
+typedef struct ArenaOptions {
+  // Measured in `sizeof(Header)` units. 0 means `default_minimum_chunk_units`.
+  size_t minimum_chunk_units;
+
+  // If true, each thread keeps a small, bounded cache of recently freed small
+  // regions, so that most `arena_malloc`/`arena_free` pairs do not need to take
+  // the arena’s lock. Each thread caches regions for at most 1 arena at a time
+  // (the 1st arena with this option that the thread uses). In an `ArenaSet`,
+  // the cache instead follows the thread from CPU to CPU: allocating from
+  // another CPU’s arena flushes it back to the old arena and binds it to the
+  // new 1.
+  bool thread_cache;
+
+  ArenaLockKind lock_kind;
+
+  ArenaFitPolicy fit_policy;
+
+  // If not 0, the arena returns idle free memory to the platform: about once
+  // every `decay_milliseconds`, it releases what `arena_trim` could release,
+  // but only from regions that have been free for at least a whole period,
+  // so that memory in steady use stays put. The check piggybacks on calls
+  // that take the arena’s lock, and only occasionally reads the clock, so an
+  // arena that nobody calls does not decay; call `arena_trim` for that.
+  unsigned decay_milliseconds;
+
+  // Regions larger than this many bytes get a memory mapping of their own,
+  // which `arena_free` unmaps immediately, instead of coming from (and going
+  // back to) the free list. 0 means `default_mapped_threshold`, and `SIZE_MAX`
+  // turns this off.
+  size_t mapped_threshold;
+
+  // If true, the arena is a _region_: `arena_malloc` simply takes the next
+  // bytes of the current `Chunk`, and `arena_free` does nothing (except for
+  // regions with mappings of their own). Memory is reclaimed all at once by
+  // `arena_reset` or `arena_destroy`. This is much faster, and wastes no space
+  // on fragmentation, if all the allocations have about the same lifetime (such
+  // as the allocations for 1 request). It overrides `thread_cache`.
+  bool region;
+
+  // If true, the thread that creates the arena _owns_ it, and `arena_free`
+  // calls from other threads do not take the arena’s lock: each pushes its
+  // region onto a lock-free stack, with 1 compare-and-swap. The next
+  // `arena_malloc`, `arena_free`, or `arena_trim` call to take the lock
+  // (usually the owner’s) frees the whole stack at once. This suits pipelines
+  // in which 1 thread allocates and others free, which would otherwise
+  // contend with the owner for the lock.
+  //
+  // Regions on the stack count as in use until then, so if the owner stops
+  // allocating, call `arena_trim` now and then to collect them. Other calls
+  // (`arena_realloc`, `arena_free_batch`, and so on) take the lock as usual.
+  // It is overridden by `region`.
+  bool remote_frees;
+
+  // If true, chunks are backed by huge pages where the platform allows, so
+  // that programs that touch much of the arena miss the TLB less often. Each
+  // chunk is a whole number of huge pages, aligned to the huge page size (and
+  // a chunk of `default_minimum_chunk_units` is exactly 1 huge page). We use
+  // explicitly reserved huge pages (Linux’ `MAP_HUGETLB`) if there are any,
+  // and otherwise ask for transparent huge pages (`MADV_HUGEPAGE`).
+  //
+  // Releasing part of a chunk (see `arena_trim`) breaks its huge pages up, so
+  // this goes best with a `minimum_chunk_units` large enough that whole chunks
+  // become free.
+  bool huge_pages;
+
+  // If not `NULL`, the arena gets its `Chunk`s from this arena (as regions
+  // from its chunks, whatever its `mapped_threshold`) rather than from the
+  // platform, and gives them back to it. This suits nested lifetimes, such as
+  // an arena per request in a server with an arena per connection: the inner
+  // arenas reuse memory that the outer one has already faulted in. Choose a
+  // `minimum_chunk_units` well below the parent’s, so that several chunks fit
+  // in each of its chunks. It overrides `huge_pages`.
+  //
+  // The parent must outlive the arena. Resetting or destroying the parent
+  // destroys the arena first (see `arena_destroy`), and a parent can’t have
+  // marks while it has children (see `arena_mark`). A parent in region mode is
+  // ignored, since its chunks would never come back to it until it was reset.
+  Arena* parent;
+
+  // If not 0, the arena profiles its allocations: it samples about 1 region
+  // per `sample_bytes` bytes allocated, records the call stack of each sampled
+  // region, and tracks the sampled regions until they are freed. Use
+  // `arena_write_profile` to see where the live memory came from. Allocations
+  // that are not sampled cost only a per-thread countdown. See
+  // `default_sample_bytes`.
+  size_t sample_bytes;
+} ArenaOptions;
+
+// The default value for `ArenaOptions.mapped_threshold`: regions that would not
+// fit in a chunk of `default_minimum_chunk_units`.
+extern const size_t default_mapped_threshold;
+
+// A reasonable value for `ArenaOptions.sample_bytes` (512 KiB), which keeps a
+// few thousand samples for a heap of 1 GiB.
+extern const size_t default_sample_bytes;
+
+// Initializes the new `Arena` as `arena_create` does, with the given `options`.
+void arena_create_with_options(Arena* a, const ArenaOptions* options)
+    __attribute__((nonnull));
+
 // Returns a pointer to a memory region containing at least `count * size`
 // bytes. Checks the multiplication for overflow.
 //
@@ -31,25 +172,408 @@ extern const size_t default_minimum_chunk_units;
 void* arena_malloc(Arena* a, size_t count, size_t size)
     __attribute__((malloc, nonnull));
 
-// Puts the memory region that `p` points to back onto the free list.
+// Like `arena_malloc`, but fills the memory region with 0 bytes. Memory that
+// is known to be 0 already (such as memory fresh from the platform) is not
+// written again, and large regions are zeroed by getting fresh pages from the
+// platform, rather than by writing every byte.
+void* arena_calloc(Arena* a, size_t count, size_t size)
+    __attribute__((malloc, nonnull));
+
+// Like `arena_malloc`, but the returned pointer is a multiple of `alignment`,
+// which must be a power of 2 (such as a cache line or page size). The region
+// can be freed with `arena_free`. (It can also be resized with
+// `arena_realloc`, but the new region is guaranteed to be aligned only as
+// `arena_malloc` would align it.)
+//
+// Returns `NULL` and sets `errno` if there was an error.
+void* arena_aligned_malloc(Arena* a, size_t alignment, size_t count,
+                           size_t size) __attribute__((malloc, nonnull));
+
+// Puts the memory region that `p` points to back onto the free list (or, if it
+// has a mapping of its own, unmaps it).
 void arena_free(Arena* a, void* p) __attribute__((nonnull));
 
-// Returns all memory in the `Arena` back to the platform. All allocations made
-// inside the arena will be invalid after this function returns.
+// Allocates up to `n` regions of `size` bytes each, as if by `arena_malloc`,
+// storing pointers to them in `out`. The whole batch takes the arena’s lock
+// only once, and runs of regions are carved from 1 free region where possible,
+// so that they are contiguous.
+//
+// Returns how many regions were allocated (and stored at the start of `out`).
+// If that is fewer than `n`, sets `errno`.
+size_t arena_malloc_batch(Arena* a, size_t n, size_t size, void** out)
+    __attribute__((nonnull));
+
+// Frees the `n` memory regions in `ptrs`, as if by `arena_free`, but takes the
+// arena’s lock only once. Runs of regions that are adjacent both in `ptrs` and
+// in memory (such as those from `arena_malloc_batch`, in the same order) are
+// coalesced with each other and put back as 1 region.
+void arena_free_batch(Arena* a, size_t n, void** ptrs) __attribute__((nonnull));
+
+// Returns free memory to the platform, keeping up to `keep_bytes` of it for
+// future allocations. `Chunk`s that are entirely free are unmapped, and the
+// whole pages inside other large free regions are released (but stay mapped,
+// and come back zeroed when next touched).
+void arena_trim(Arena* a, size_t keep_bytes) __attribute__((nonnull));
+
+// Flags for `arena_reserve`.
+typedef enum ArenaReserveFlags {
+  // Fault the pages in now, rather than when allocations first touch them.
+  // Where the platform allows, the kernel does it inside `mmap` (Linux’
+  // `MAP_POPULATE`).
+  arena_reserve_populate = 1,
+
+  // Like `arena_reserve_populate`, but touch the pages from 1 thread per CPU.
+  // The kernel populates a mapping on 1 thread, so this is faster for large
+  // reservations on machines with many CPUs.
+  arena_reserve_parallel = 2,
+} ArenaReserveFlags;
+
+// Gets a `Chunk` of at least `byte_count` bytes now (from the platform, the
+// chunk cache, or the parent arena; see `ArenaOptions.parent`), and makes it
+// free (or, in region mode, next in line), so that later allocations need not
+// wait for `mmap` or, with `flags`, for page faults. This suits programs that
+// know their working set at startup, and would rather not pay for it on their
+// 1st requests. `flags` is 0 or a combination of `ArenaReserveFlags`, and
+// applies wherever the chunk came from.
+//
+// `arena_trim` and decay (see `ArenaOptions.decay_milliseconds`) keep as many
+// free bytes as have been reserved, on top of what they would otherwise keep.
+// Regions with mappings of their own (see `ArenaOptions.mapped_threshold`)
+// still come from the platform.
+//
+// Returns false and sets `errno` if there was an error.
+bool arena_reserve(Arena* a, size_t byte_count, unsigned flags)
+    __attribute__((nonnull));
+
+// Resizes the memory region that `p` points to so that it holds at least
+// `count * size` bytes, preserving its contents up to the lesser of the old and
+// new sizes. If `p` is `NULL`, this is the same as `arena_malloc`.
+//
+// Shrinking always happens in place. Growing happens in place if the region
+// after `p` is free and large enough (or if `p` is the only region in its
+// `Chunk`, in which case the platform may be able to grow the chunk), and
+// otherwise moves the contents to a new region. Regions that have a mapping of
+// their own (see `ArenaOptions.mapped_threshold`) are resized by remapping.
+//
+// Returns `NULL` and sets `errno` if there was an error, in which case `p` is
+// still valid.
+void* arena_realloc(Arena* a, void* p, size_t count, size_t size)
+    __attribute__((nonnull(1)));
+
+// Returns how many bytes the region that `p` points to can actually hold, which
+// may be more than were asked for.
+size_t arena_get_usable_size(const void* p) __attribute__((nonnull));
+
+// Returns the `Arena` that the region that `p` points to came from, in constant
+// time, or `NULL` if `p` is not in any arena’s `Chunk`s. (`p` must be a region
+// from an `arena_malloc`-family function that has not been freed.)
+Arena* arena_get_owner(const void* p) __attribute__((nonnull));
+
+// Frees every allocation in the `Arena` at once, but keeps its `Chunk`s (and
+// their already-faulted-in pages) for reuse. Regions that have mappings of
+// their own are unmapped. In region mode (see `ArenaOptions.region`), this just
+// rewinds allocation to the start of the 1st chunk.
+//
+// Like `arena_destroy`, this discards regions held in other threads’ caches,
+// and destroys the arena’s children, so the caller must ensure that no other
+// thread is using the arena (or its children) concurrently.
+void arena_reset(Arena* a) __attribute__((nonnull));
+
+enum { arena_search_step_bucket_count = 16 };
+
+// A snapshot of an `Arena`’s counters (see `arena_get_stats`).
+typedef struct ArenaStats {
+  // How many regions have been allocated and freed. Allocations and frees that
+  // a thread’s cache serves (see `ArenaOptions.thread_cache`) are counted when
+  // the cache next takes the arena’s lock. In region mode, `arena_free` does
+  // nothing, and is not counted.
+  size_t allocation_count;
+  size_t free_count;
+
+  // The bytes in regions that are in use (including their `Header`s, and the
+  // regions held in threads’ caches), and in free regions.
+  size_t in_use_bytes;
+  size_t free_bytes;
+
+  // How many free regions there are, in the bins and on the free list (or in
+  // the tree). This is the number of regions that a search might visit.
+  size_t free_region_count;
+
+  // How many `Chunk`s the arena has and their total size, and how many regions
+  // have mappings of their own and their total size. Together, these are the
+  // bytes that the arena has mapped from the platform.
+  size_t chunk_count;
+  size_t chunk_bytes;
+  size_t mapping_count;
+  size_t mapping_bytes;
+
+  // How many times the arena has had to ask the platform for a new `Chunk`,
+  // and how many times it got 1 from the chunk cache (see `arena_destroy`) or
+  // its parent (see `ArenaOptions.parent`) instead.
+  size_t chunk_map_count;
+  size_t chunk_reuse_count;
+
+  // A histogram of how many free regions each search for a region examined
+  // (in the bins, and on the free list or in the tree). Bucket 0 counts
+  // searches that examined none, and bucket `i` counts those that examined
+  // from 2^(i - 1) up to 2^i - 1. The last bucket also counts longer searches.
+  size_t search_steps[arena_search_step_bucket_count];
+
+  // How many times a thread found the arena’s lock held and had to wait, and
+  // how many times in all waiters polled it before getting it or going to
+  // sleep.
+  size_t lock_contention_count;
+  size_t lock_spin_count;
+
+  // How many regions threads other than the owner have freed through the
+  // lock-free stack (see `ArenaOptions.remote_frees`). They also count in
+  // `free_count`, once they are collected.
+  size_t remote_free_count;
+
+  // How many live regions the profiler has sampled (see
+  // `ArenaOptions.sample_bytes`).
+  size_t sample_count;
+} ArenaStats;
+
+// Fills in `stats` with the current values of `a`’s counters. The counters are
+// always on, and cheap to maintain, and this does not take the arena’s lock.
+// The snapshot is therefore not atomic: while other threads are using the
+// arena, the counters may be slightly out of step with each other.
+void arena_get_stats(const Arena* a, ArenaStats* stats)
+    __attribute__((nonnull));
+
+// A program that forks while other threads may be using `a` must call these
+// around `fork` (for example, with `pthread_atfork`): `arena_prepare_fork`
+// before, and then `arena_parent_after_fork` in the parent and
+// `arena_child_after_fork` in the child. Otherwise, the child could inherit
+// the arena locked forever, or in the middle of an update.
+void arena_prepare_fork(Arena* a) __attribute__((nonnull));
+void arena_parent_after_fork(Arena* a) __attribute__((nonnull));
+void arena_child_after_fork(Arena* a) __attribute__((nonnull));
+
+// Returns all memory in the `Arena` back to the platform (or its parent; see
+// `ArenaOptions.parent`). All allocations made inside the arena will be invalid
+// after this function returns. Arenas that have taken chunks from this 1 (its
+// children) are destroyed first, as if by this function.
+//
+// `Chunk`s of up to a few megabytes, and the pages of descriptors for them, go
+// into a cache that all arenas share, rather than straight back to the
+// platform, so that arenas created later can take them without a system call.
+// See `arena_release_cached_chunks`.
+//
+// Regions held in other threads’ caches (see `ArenaOptions.thread_cache`) are
+// discarded, too, but the caller must ensure that no other thread is using the
+// arena concurrently.
 void arena_destroy(Arena* a) __attribute__((nonnull));
 
+// Returns the `Chunk`s (and descriptor pages) in the cache that `arena_destroy`
+// fills to the platform.
+void arena_release_cached_chunks(void);
+
+// Writes a heap profile of the live regions that `a` has sampled (see
+// `ArenaOptions.sample_bytes`) to the file descriptor `fd`, in the text format
+// of gperftools’ heap profiler, which `pprof` reads:
+//
+//   pprof -top some_program heap.profile
+//
+// Each sampled region is 1 line, with its size and call stack. `pprof` scales
+// the samples up to estimate all of the live memory. On Linux, the profile
+// ends with the process’ memory map, so that `pprof` can find the shared
+// libraries’ symbols. The arena’s lock is held only while copying the samples,
+// not while writing them, and nothing here calls `malloc`.
+//
+// Returns false and sets `errno` if there was an error.
+bool arena_write_profile(Arena* a, int fd) __attribute__((nonnull));
+
+// A point in an `Arena`’s allocations, to which `arena_release_to_mark` can
+// roll it back. Its fields are private to the arena.
+typedef struct ArenaMark {
+  struct Chunk* chunk;
+  struct Header* next;
+  size_t scoped_units;
+  size_t mapping_serial;
+  size_t sample_serial;
+  size_t depth;
+} ArenaMark;
+
+// Records the current point in `a`’s allocations in `mark`, so that
+// `arena_release_to_mark` can free everything allocated after it at once, in
+// time that does not depend on how many allocations there were. This suits
+// work that allocates a lot and then throws it all away, such as speculative
+// parsing that backtracks.
+//
+// In region mode (see `ArenaOptions.region`), the arena just rewinds. Other
+// arenas allocate as region mode does while they have a mark, from `Chunk`s
+// that they set aside for the purpose (and keep for the next mark), and
+// `arena_free` does nothing to those allocations; regions allocated before the
+// mark are freed as usual.
+//
+// Marks nest like a stack: releasing a mark also releases the marks taken after
+// it. Everything allocated after the mark, by any thread, is freed, including
+// regions that `arena_realloc` moved and regions with mappings of their own.
+//
+// Returns false and sets `errno` if there was an error. Arenas with
+// `ArenaOptions.thread_cache` do not support marks (`EINVAL`), and neither do
+// arenas whose children hold chunks from them (`EBUSY`), since releasing the
+// mark would take those chunks back. While an arena has a mark, arenas that
+// would take a new chunk from it fail with `EBUSY` instead.
+bool arena_mark(Arena* a, ArenaMark* mark) __attribute__((nonnull));
+
+// Frees every region allocated from `a` since `arena_mark` filled in `mark`,
+// and releases `mark` (and any marks taken after it). Regions freed this way
+// must not be used again. To roll back repeatedly, take a new mark each time.
+void arena_release_to_mark(Arena* a, const ArenaMark* mark)
+    __attribute__((nonnull));
+
+// An `ArenaPool` allocates objects of 1 fixed size from _slabs_ that it gets
+// from a parent `Arena`. Objects carry no `Header`, and free objects are kept
+// on a list threaded through the objects themselves, so both allocating and
+// freeing take constant time, and objects are packed as tightly as their size
+// and alignment allow. This suits programs that allocate many identical
+// objects, such as the nodes of a tree or list.
+//
+// Slabs go back to the parent only when the pool is destroyed. Resetting or
+// destroying the parent invalidates the pool (and its objects).
+typedef struct ArenaPool ArenaPool;
+
+// Initializes the new `ArenaPool` `p` to allocate objects of `object_size`
+// bytes from `parent`. Each object’s address is a multiple of `alignment`,
+// which must be a power of 2.
+//
+// Returns false and sets `errno` if there was an error.
+bool arena_pool_create(ArenaPool* p, Arena* parent, size_t object_size,
+                       size_t alignment) __attribute__((nonnull));
+
+// Returns a pointer to an object of the pool’s size, getting a new slab from
+// the parent arena if there are no free objects.
+//
+// Returns `NULL` and sets `errno` if there was an error.
+void* arena_pool_malloc(ArenaPool* p) __attribute__((malloc, nonnull));
+
+// Puts `object`, which must have come from `arena_pool_malloc(p)`, back on the
+// pool’s free list.
+void arena_pool_free(ArenaPool* p, void* object) __attribute__((nonnull));
+
+// Returns all of the pool’s slabs to its parent arena. All objects allocated
+// from the pool will be invalid after this function returns.
+void arena_pool_destroy(ArenaPool* p) __attribute__((nonnull));
+
+// An `ArenaSet` is a set of `Arena`s, 1 per CPU. Each allocation uses the arena
+// of the CPU that the calling thread is running on, so threads rarely contend
+// for a lock unless they share a CPU, and the set’s memory grows with the
+// number of CPUs rather than the number of threads. (Per-thread arenas can’t
+// share their chunks’ free space, so thousands of mostly idle threads would
+// each hold on to a chunk.)
+//
+// A thread that migrates to another CPU in the middle of a call just finishes
+// with its old CPU’s arena: every arena has its own lock, so that costs at
+// most a little contention. Frees and reallocations always go back to the
+// arena that the region came from (see `arena_get_owner`), whichever CPU the
+// caller is on.
+typedef struct ArenaSet ArenaSet;
+
+// Initializes the new `ArenaSet` `s` with 1 arena for each CPU that the
+// platform has configured, each created with `options`. `remote_frees` is
+// ignored, since no thread owns a CPU’s arena. Thread caches (see
+// `ArenaOptions.thread_cache`) follow their threads to the arena of the CPU
+// they allocate on.
+//
+// Returns false and sets `errno` if there was an error.
+bool arena_set_create(ArenaSet* s, const ArenaOptions* options)
+    __attribute__((nonnull));
+
+// These work like their `arena_` counterparts, on the calling CPU’s arena.
+void* arena_set_malloc(ArenaSet* s, size_t count, size_t size)
+    __attribute__((malloc, nonnull));
+void* arena_set_calloc(ArenaSet* s, size_t count, size_t size)
+    __attribute__((malloc, nonnull));
+void* arena_set_aligned_malloc(ArenaSet* s, size_t alignment, size_t count,
+                               size_t size) __attribute__((malloc, nonnull));
+
+// These work like their `arena_` counterparts, on the arena that `p` came
+// from. `arena_set_realloc` keeps the region in that arena.
+void arena_set_free(ArenaSet* s, void* p) __attribute__((nonnull));
+void* arena_set_realloc(ArenaSet* s, void* p, size_t count, size_t size)
+    __attribute__((nonnull(1)));
+
+// Calls `arena_trim` on each arena, so each keeps up to `keep_bytes`.
+void arena_set_trim(ArenaSet* s, size_t keep_bytes) __attribute__((nonnull));
+
+// Fills in `stats` with the sums of the arenas’ counters (see
+// `arena_get_stats`).
+void arena_set_get_stats(const ArenaSet* s, ArenaStats* stats)
+    __attribute__((nonnull));
+
+// Writes 1 heap profile of all of the arenas’ samples (see
+// `arena_write_profile`).
+bool arena_set_write_profile(ArenaSet* s, int fd) __attribute__((nonnull));
+
+// These work like their `arena_` counterparts (see `arena_prepare_fork`), on
+// all of the set’s arenas.
+void arena_set_prepare_fork(ArenaSet* s) __attribute__((nonnull));
+void arena_set_parent_after_fork(ArenaSet* s) __attribute__((nonnull));
+void arena_set_child_after_fork(ArenaSet* s) __attribute__((nonnull));
+
+// Destroys all of the set’s arenas (see `arena_destroy`).
+void arena_set_destroy(ArenaSet* s) __attribute__((nonnull));
+
 // Implementation details below this point.
 
-// A `Chunk` is a unit of memory provided from outside the allocator (such as
-// the OS via `mmap`). This list keeps track of them so that we can release them
-// back to the OS.
+// A `Chunk` describes a unit of memory provided from outside the allocator
+// (such as the OS via `mmap`). This list keeps track of them so that we can
+// release them back to the OS.
+//
+// The descriptors live apart from the memory they describe, in `ChunkSlab`s, so
+// that all of a chunk’s memory holds regions (and stays aligned as the
+// platform gave it to us). The _chunk map_ (see `find_chunk`) finds the
+// descriptor for any address in constant time.
 typedef struct Chunk {
   struct Chunk* next;
   size_t byte_count;
+
+  // How many units at the start of the chunk may not be zero: in region mode,
+  // those that have ever been allocated, and all of them if the chunk’s memory
+  // was used before (see `arena_destroy`).
+  size_t dirty_units;
+
+  // The chunk’s memory, which starts with its 1st region, and the arena that
+  // owns it.
+  struct Header* start;
+  Arena* arena;
+
+  // If the chunk’s memory is a region of a parent arena (see
+  // `ArenaOptions.parent`), the parent’s chunk that holds it, whose entries in
+  // the chunk map the chunk takes over. Otherwise, `NULL`.
+  struct Chunk* parent_chunk;
 } Chunk;
 
-// A `Header` describes an entry in an `Arena`’s free list: a region of memory
-// that can be divided up and returned to the caller.
+// A `ChunkSlab` is a page of `Chunk` descriptors. It sits at the start of the
+// page, before the descriptors, and links the arena’s slabs together so that
+// `arena_destroy` can find them.
+typedef struct ChunkSlab {
+  struct ChunkSlab* next;
+} ChunkSlab;
+
+// A `Mapping` is a dedicated memory mapping for 1 large region (see
+// `ArenaOptions.mapped_threshold`). It sits immediately before the region’s
+// `Header`, and links the arena’s mappings together so that `arena_destroy` can
+// find them.
+typedef struct Mapping {
+  struct Mapping* next;
+  struct Mapping* previous;
+
+  // The arena whose list this is on (see `arena_get_owner`).
+  Arena* arena;
+
+  // The mapping’s place in the order in which the arena made its mappings (see
+  // `arena_release_to_mark`).
+  size_t serial;
+} Mapping;
+
+// A `Header` describes a region of memory in an `Arena`: 1 that is in use, or
+// 1 in the free list or the bins that can be divided up and returned to the
+// caller. Free regions also carry boundary tags (see `get_previous` and
+// `set_footer`).
 typedef struct Header {
   struct Header* next;
   size_t unit_count;
@@ -57,12 +581,76 @@ typedef struct Header {
   // char _[count];
 } Header;
 
+enum { lock_wait_slot_count = 16 };
+
+// The lock that protects an `Arena`. Which fields are used depends on `kind`.
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+typedef struct Lock {
+  ArenaLockKind kind;
+
+  // Used by `arena_lock_spin`.
+  atomic_flag flag;
+
+  // Used by `arena_lock_mutex`: 0 if unlocked, 1 if locked, and 2 if locked
+  // and there may be threads asleep waiting for it.
+  atomic_uint state;
+
+  // Used by `arena_lock_ticket`. The holder of ticket `t` sleeps on
+  // `wait_slots[t % lock_wait_slot_count]`, so that `unlock` can wake just
+  // the next ticket holder. `waiters` counts the threads that are (about to
+  // be) asleep, so that `unlock` can skip waking anyone if there are none.
+  atomic_uint next_ticket;
+  atomic_uint now_serving;
+  atomic_uint waiters;
+  atomic_uint wait_slots[lock_wait_slot_count];
+
+  // See `ArenaStats.lock_contention_count` and `ArenaStats.lock_spin_count`.
+  // Only waiters update these.
+  atomic_size_t contention_count;
+  atomic_size_t spin_count;
+} Lock;
+#pragma clang diagnostic pop
+
 // `long double` is (probably) the largest machine type. (If it’s not on your
 // machine, change this `typedef`.) To ensure that allocations are properly
 // aligned for all machine types, we assert that `Header` (the minimum unit of
 // allocation) has the right size. This may require padding.
 typedef long double Alignment;
 static_assert(sizeof(Header) == sizeof(Alignment), "Add padding to `Header`");
+static_assert(sizeof(Mapping) % sizeof(Alignment) == 0,
+              "Add padding to `Mapping`");
+
+// Free regions smaller than `maximum_binned_units` are kept in size-class bins
+// instead of on the free list. Bins below
+// `exact_bin_count` hold regions of exactly that many units; the rest are
+// log-spaced, 4 bins per power of 2. See `get_bin_index`.
+enum {
+  exact_bin_count = 32,
+  bin_count = 64,
+  maximum_binned_units = 1 << 13,
+};
+
+// The counters behind `ArenaStats` (which see). Only holders of the arena’s
+// lock change them (except for `remote_free_count`, which is incremented
+// atomically), but `arena_get_stats` reads them without it. Sizes are counted
+// in units.
+typedef struct Stats {
+  atomic_size_t allocation_count;
+  atomic_size_t free_count;
+  atomic_size_t in_use_units;
+  atomic_size_t free_units;
+  atomic_size_t free_region_count;
+  atomic_size_t chunk_count;
+  atomic_size_t chunk_bytes;
+  atomic_size_t mapping_count;
+  atomic_size_t mapping_bytes;
+  atomic_size_t chunk_map_count;
+  atomic_size_t chunk_reuse_count;
+  atomic_size_t search_steps[arena_search_step_bucket_count];
+  atomic_size_t remote_free_count;
+  atomic_size_t sample_count;
+} Stats;
 
 // An `Arena` is metadata that describes a set of `Chunk`s and the `Header`s
 // that make up its free list. A caller can create and use as many arenas as
@@ -70,25 +658,183 @@ static_assert(sizeof(Header) == sizeof(Alignment), "Add padding to `Header`");
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
 struct Arena {
-  // This implementation uses a simple spin lock. Under contention, it starts
-  // affecting performance.
-  atomic_flag lock;
+  // All fields below are protected by this lock. See `ArenaLockKind`.
+  Lock lock;
 
   // The head of the chunk list.
   Chunk* chunk_list;
 
-  // The head of the free list.
-  Header free_list;
+  // The pages that hold the arena’s `Chunk` descriptors, and the descriptors
+  // that are not in use, linked through `Chunk.next`.
+  ChunkSlab* chunk_slabs;
+  Chunk* free_chunks;
 
-  // Where we last left off in a search of the free list.
-  //
-  // `NULL` is a sentinel value indicating that `free_list` has not yet been
-  // initialized.
+  // See `ArenaOptions.fit_policy`.
+  ArenaFitPolicy fit_policy;
+
+  // With `arena_fit_next`, the free list is a circular, doubly-linked list of
+  // the free regions too large for the bins, in no particular order. This is
+  // where we last left off in a search of it, or `NULL` if it is empty.
   Header* free_list_start;
 
+  // With `arena_fit_best`, those regions form an AVL tree instead, ordered by
+  // size and then address. This is its root.
+  Header* free_tree;
+
+  // Size-class bins of free regions, each a `NULL`-terminated, doubly-linked
+  // list. Like the regions on the free list, binned regions have already been
+  // coalesced with their neighbors.
+  Header* bins[bin_count];
+
+  // Bit `i` is set if and only if `bins[i]` is non-empty.
+  uint64_t bin_map;
+
+  // See `ArenaOptions.thread_cache`. `in_set` is true for the arenas of an
+  // `ArenaSet`, which thread caches move to when they allocate.
+  bool use_thread_cache;
+  bool in_set;
+
+  // See `ArenaOptions.remote_frees`. `remote_frees` is the stack of regions
+  // that threads other than `owner` have freed, linked through `Header.next`.
+  // Unlike the other fields, it is not protected by the lock: anyone can push
+  // onto it, and holders of the lock take the whole stack at once.
+  bool use_remote_frees;
+  pthread_t owner;
+  _Atomic(Header*) remote_frees;
+
+  // The threads’ caches that currently hold regions from this arena, so that
+  // `arena_destroy` can empty them.
+  struct ThreadCache* thread_caches;
+
+  // See `ArenaOptions.decay_milliseconds`. `next_decay` is a time in
+  // nanoseconds on the monotonic clock. `decay_epoch` counts the times the
+  // arena has decayed; each free region records the epoch it was freed in
+  // (see `get_free_epoch`), so that decay can tell how long it has been idle.
+  int64_t decay_nanoseconds;
+  int64_t next_decay;
+  size_t decay_epoch;
+  unsigned calls_since_decay_check;
+
+  // The head of the list of regions that have mappings of their own, and the
+  // size (in units, including the `Header`) above which regions get one.
+  Mapping* mappings;
+  size_t mapped_units;
+
+  // The `Mapping.serial` of the next mapping.
+  size_t next_mapping_serial;
+
+  // See `ArenaOptions.region`. In region mode, `chunk_list` is in the order in
+  // which we allocate from the chunks, and we allocate from `region_next` up to
+  // `region_end` in `current_chunk`. Regions at or after `region_clean` are
+  // still zero.
+  bool region;
+  Chunk* current_chunk;
+  Header* region_next;
+  Header* region_end;
+  Header* region_clean;
+
+  // See `arena_mark`. `mark_depth` counts the marks that have not been
+  // released. Outside region mode, while it is not 0, we allocate from
+  // `current_chunk` as in region mode, and `scoped_chunks` is the list of the
+  // chunks for that, in order. `scoped_units` counts all the units allocated
+  // that way (or in region mode), so that releasing a mark can subtract those
+  // allocated since. `mark_chunk` and `mark_next` are where the most recent
+  // mark (or release) left `current_chunk` and `region_next`; regions before
+  // that point must not grow in place.
+  size_t mark_depth;
+  Chunk* scoped_chunks;
+  size_t scoped_units;
+  Chunk* mark_chunk;
+  Header* mark_next;
+
   // We always request at least this amount from the operating system. The value
   // should be chosen (a) to reduce pressure on the page table; and (b) to
   // reduce the number of times we need to invoke the kernel.
   size_t minimum_chunk_units;
+
+  // The sum of the `arena_reserve` calls’ chunks, which `arena_trim` and decay
+  // keep.
+  size_t reserved_bytes;
+
+  // See `ArenaOptions.huge_pages`.
+  bool use_huge_pages;
+
+  // See `ArenaOptions.parent`. `children` is the list of arenas that have
+  // taken chunks from this 1 since they were last destroyed, linked through
+  // `next_sibling` and `previous_sibling`; `is_child` says whether this arena
+  // is on its parent’s list. The list and those 3 fields are protected by the
+  // parent’s lock.
+  Arena* parent;
+  Arena* children;
+  Arena* next_sibling;
+  Arena* previous_sibling;
+  bool is_child;
+
+  // See `ArenaOptions.sample_bytes`. `samples` is a hash table of the live
+  // sampled regions, 1 page of buckets, mapped when the 1st region is sampled.
+  // The `Sample` records live in `sample_slabs`, like `Chunk` descriptors, and
+  // those not in use are linked through `Sample.next` from `free_samples`.
+  // `next_sample_serial` numbers the samples, so that `arena_release_to_mark`
+  // can tell which came after a mark.
+  size_t sample_bytes;
+  struct Sample** samples;
+  struct Sample* free_samples;
+  struct SampleSlab* sample_slabs;
+  size_t next_sample_serial;
+
+  Stats stats;
+};
+#pragma clang diagnostic pop
+
+// A `Slab` is a region from a pool’s parent arena that the pool carves into
+// objects. It sits at the start of the region, before the 1st object, and links
+// the pool’s slabs together so that `arena_pool_destroy` can find them.
+typedef struct Slab {
+  struct Slab* next;
+} Slab;
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct ArenaPool {
+  // All fields below are protected by this lock, which is of the same kind as
+  // the parent’s.
+  Lock lock;
+
+  Arena* parent;
+
+  // `object_size` is a multiple of `alignment`, and large enough to hold the
+  // free list’s link.
+  size_t object_size;
+  size_t alignment;
+
+  // The size of each slab, and the offset of its 1st object.
+  size_t slab_byte_count;
+  size_t slab_header_size;
+
+  // The head of the list of slabs.
+  Slab* slabs;
+
+  // The free objects, each of which points to the next.
+  void* free_list;
+
+  // Objects in the newest slab from `fresh_next` up to `fresh_end` have never
+  // been allocated. We carve them off 1 at a time, rather than linking them all
+  // onto the free list at once, so that we don’t touch the whole slab up front.
+  char* fresh_next;
+  char* fresh_end;
+};
+#pragma clang diagnostic pop
+
+// Each CPU’s arena starts on a cache line of its own, so that CPUs don’t
+// contend for the lines where 1 arena ends and the next begins.
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+typedef struct CPUArena {
+  _Alignas(64) Arena arena;
+} CPUArena;
+
+struct ArenaSet {
+  CPUArena* arenas;
+  size_t arena_count;
 };
 #pragma clang diagnostic pop
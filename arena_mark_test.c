@@ -0,0 +1,124 @@
+// Copyright 2022 by [Chris Palmer](https://noncombatant.org)
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#include "arena_malloc.h"
+#include "get_utc_nanoseconds.h"
+
+static const char HelpMessage[] =
+    "Measures the cost of throwing away a burst of allocations, as a\n"
+    "backtracking parser does. Each of `attempt_count` attempts makes\n"
+    "`allocation_count` allocations of up to `allocation_size` bytes (writing\n"
+    "to each), keeps every 16th, and throws the rest away.\n"
+    "\n"
+    "`discard` says how:\n"
+    "\n"
+    "  free  `arena_free` on each allocation, in reverse order\n"
+    "  mark  `arena_release_to_mark` (the kept allocations are made before\n"
+    "        the mark)\n"
+    "\n"
+    "Usage: arena_mark_test discard attempt_count allocation_count "
+    "allocation_size\n";
+
+static uint64_t random_state = 1;
+
+// xorshift64, so that every platform sees the same sizes.
+static uint64_t get_random(void) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return random_state;
+}
+
+static noreturn void help() {
+  fprintf(stderr, HelpMessage);
+  exit(1);
+}
+
+static char* allocate(Arena* a, size_t allocation_size) {
+  const size_t size = 1 + get_random() % allocation_size;
+  char* p = arena_malloc(a, 1, size);
+  if (p == NULL) {
+    printf("%s\n", strerror(errno));
+    exit(errno);
+  }
+  memset(p, 1, size);
+  return p;
+}
+
+int main(int count, char* arguments[]) {
+  if (count != 5) {
+    help();
+  }
+  bool use_mark;
+  if (strcmp(arguments[1], "free") == 0) {
+    use_mark = false;
+  } else if (strcmp(arguments[1], "mark") == 0) {
+    use_mark = true;
+  } else {
+    help();
+  }
+  const size_t attempt_count = strtoul(arguments[2], NULL, 0);
+  const size_t allocation_count = strtoul(arguments[3], NULL, 0);
+  const size_t allocation_size = strtoul(arguments[4], NULL, 0);
+  if (attempt_count == 0 || allocation_count == 0 || allocation_size == 0) {
+    help();
+  }
+
+  char** allocations = calloc(allocation_count, sizeof(char*));
+  if (allocations == NULL) {
+    printf("%s\n", strerror(errno));
+    return errno;
+  }
+  Arena a;
+  arena_create_with_options(&a, &(ArenaOptions){0});
+  size_t kept_count = 0;
+  const int64_t start = GetMonotonicNanoseconds();
+  for (size_t i = 0; i < attempt_count; i++) {
+    if (use_mark) {
+      for (size_t j = 0; j < allocation_count; j += 16) {
+        allocate(&a, allocation_size);
+        kept_count++;
+      }
+      ArenaMark mark;
+      if (!arena_mark(&a, &mark)) {
+        printf("%s\n", strerror(errno));
+        return errno;
+      }
+      for (size_t j = 0; j < allocation_count; j++) {
+        if (j % 16 != 0) {
+          allocate(&a, allocation_size);
+        }
+      }
+      arena_release_to_mark(&a, &mark);
+    } else {
+      for (size_t j = 0; j < allocation_count; j++) {
+        allocations[j] = allocate(&a, allocation_size);
+      }
+      for (size_t j = allocation_count; j > 0; j--) {
+        if ((j - 1) % 16 != 0) {
+          arena_free(&a, allocations[j - 1]);
+        } else {
+          kept_count++;
+        }
+      }
+    }
+  }
+  const int64_t end = GetMonotonicNanoseconds();
+
+  ArenaStats stats;
+  arena_get_stats(&a, &stats);
+  printf("%s: ns per allocation: %.1f, kept: %zu, in use: %zu KiB\n",
+         arguments[1],
+         (double)(end - start) / (double)(attempt_count * allocation_count),
+         kept_count, stats.in_use_bytes / 1024);
+
+  arena_destroy(&a);
+  free(allocations);
+}
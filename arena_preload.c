@@ -0,0 +1,406 @@
+// Copyright 2022 by [Chris Palmer](https://noncombatant.org)
+// SPDX-License-Identifier: Apache-2.0
+
+// A drop-in replacement for the platform’s `malloc` family, built on
+// `arena_malloc`, so that unmodified programs can use the allocator:
+//
+//   LD_PRELOAD=./libarena_malloc.so some_program
+//
+// Allocations come from an `ArenaSet`, with an arena per CPU and thread caches
+// (see `ArenaOptions.thread_cache`), so that most small allocations and frees
+// take no lock at all, and the rest rarely wait for 1. Frees and reallocations
+// go back to the arena that the region came from, which `arena_get_owner`
+// finds, since threads often free what other threads allocated.
+//
+// If the environment variable `ARENA_TRACE` is set, the library also records
+// every call in the format described in arena_trace.h, for arena_replay.c to
+// replay. `%p` in its value is replaced by the process ID, so that processes
+// that `exec` other programs (which inherit the environment) do not overwrite
+// each other’s traces:
+//
+//   ARENA_TRACE=trace.%p LD_PRELOAD=./libarena_malloc.so some_program
+//
+// If `ARENA_PROFILE` is set, the arenas sample allocations (see
+// `ArenaOptions.sample_bytes`), and the library writes a heap profile of the
+// live samples, for `pprof`, when the process exits. `%p` works as it does for
+// `ARENA_TRACE`:
+//
+//   ARENA_PROFILE=heap.%p LD_PRELOAD=./libarena_malloc.so some_program
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena_malloc.h"
+#include "arena_trace.h"
+#include "get_utc_nanoseconds.h"
+
+// The library is built with `-fvisibility=hidden`, so that it exports only
+// these.
+#pragma GCC visibility push(default)
+void* malloc(size_t size);
+void free(void* p);
+void* calloc(size_t count, size_t size);
+void* realloc(void* p, size_t size);
+void* reallocarray(void* p, size_t count, size_t size);
+int posix_memalign(void** p, size_t alignment, size_t size);
+void* aligned_alloc(size_t alignment, size_t size);
+void* memalign(size_t alignment, size_t size);
+void* valloc(size_t size);
+void* pvalloc(size_t size);
+size_t malloc_usable_size(void* p);
+#pragma GCC visibility pop
+
+static ArenaSet set;
+static atomic_bool initialized;
+static atomic_flag initializing = ATOMIC_FLAG_INIT;
+
+// The 1st call to any of our functions may come very early, for example from
+// the dynamic linker or from another library’s constructor, so we create the
+// set on demand. Creating it maps its arenas directly, and allocates nothing,
+// so this cannot recurse.
+static ArenaSet* get_set(void) {
+  if (!atomic_load_explicit(&initialized, memory_order_acquire)) {
+    while (atomic_flag_test_and_set_explicit(&initializing,
+                                             memory_order_acquire)) {
+    }
+    if (!atomic_load_explicit(&initialized, memory_order_relaxed)) {
+      // `getenv` does not allocate.
+      const bool profile = getenv("ARENA_PROFILE") != NULL;
+      if (!arena_set_create(
+              &set, &(ArenaOptions){.thread_cache = true,
+                                    .sample_bytes =
+                                        profile ? default_sample_bytes : 0})) {
+        abort();
+      }
+      atomic_store_explicit(&initialized, true, memory_order_release);
+    }
+    atomic_flag_clear_explicit(&initializing, memory_order_release);
+  }
+  return &set;
+}
+
+// Tracing state. Records are appended to `trace_buffer` under `trace_lock`,
+// and the buffer is written out whenever it fills. The lock serializes every
+// call while tracing, which slows the traced program down but guarantees that
+// the records are in an order that actually happened.
+static atomic_bool tracing;
+static int trace_file = -1;
+static atomic_flag trace_lock = ATOMIC_FLAG_INIT;
+static TraceRecord trace_buffer[1024];
+static size_t trace_count;
+static int64_t trace_start;
+static atomic_uint_least32_t trace_thread_count;
+static _Thread_local uint32_t trace_thread;
+
+// `ARENA_TRACE`, which we must keep in order to open a new trace in children.
+static const char* trace_pattern;
+
+static void lock_trace(void) {
+  while (atomic_flag_test_and_set_explicit(&trace_lock,
+                                           memory_order_acquire)) {
+  }
+}
+
+static void unlock_trace(void) {
+  atomic_flag_clear_explicit(&trace_lock, memory_order_release);
+}
+
+static void stop_trace(void) {
+  atomic_store_explicit(&tracing, false, memory_order_relaxed);
+  close(trace_file);
+  trace_file = -1;
+}
+
+// Writes and empties `trace_buffer`. If writing fails, stops tracing rather
+// than leave a trace with a gap in it.
+static void flush_trace(void) {
+  const char* p = (const char*)trace_buffer;
+  size_t remaining = trace_count * sizeof(TraceRecord);
+  while (remaining != 0) {
+    const ssize_t written = write(trace_file, p, remaining);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      stop_trace();
+      break;
+    }
+    p += written;
+    remaining -= (size_t)written;
+  }
+  trace_count = 0;
+}
+
+// Formats `pattern` into `path`, replacing `%p` with the process ID. We format
+// the name by hand, because `snprintf` might call `malloc`.
+//
+// Returns false if the name does not fit.
+static bool format_path(const char* pattern, char path[PATH_MAX]) {
+  size_t length = 0;
+  for (const char* c = pattern; *c != '\0'; c++) {
+    char digits[16];
+    size_t digit_count = 0;
+    if (c[0] == '%' && c[1] == 'p') {
+      for (pid_t pid = getpid(); pid != 0; pid /= 10) {
+        digits[digit_count++] = (char)('0' + pid % 10);
+      }
+      c++;
+    } else {
+      digits[digit_count++] = *c;
+    }
+    if (length + digit_count >= PATH_MAX) {
+      return false;
+    }
+    while (digit_count != 0) {
+      path[length++] = digits[--digit_count];
+    }
+  }
+  path[length] = '\0';
+  return true;
+}
+
+// Opens a new trace named by `trace_pattern` for this process, and writes its
+// `TraceHeader`.
+static void open_trace(void) {
+  char path[PATH_MAX];
+  if (!format_path(trace_pattern, path)) {
+    return;
+  }
+  trace_file = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace_file < 0) {
+    return;
+  }
+  TraceHeader header = {.magic = TRACE_MAGIC,
+                        .version = TRACE_VERSION,
+                        .record_size = sizeof(TraceRecord)};
+  if (write(trace_file, &header, sizeof(header)) != sizeof(header)) {
+    stop_trace();
+    return;
+  }
+  trace_start = GetMonotonicNanoseconds();
+  atomic_store_explicit(&tracing, true, memory_order_relaxed);
+}
+
+static void record(TraceOperation operation, const void* object, size_t size,
+                   size_t alignment) {
+  if (!atomic_load_explicit(&tracing, memory_order_relaxed)) {
+    return;
+  }
+  // Tracing must not change `errno`, which `malloc` and `free` must preserve
+  // when they succeed.
+  const int e = errno;
+  if (trace_thread == 0) {
+    trace_thread = atomic_fetch_add_explicit(&trace_thread_count, 1,
+                                             memory_order_relaxed) +
+                   1;
+  }
+  lock_trace();
+  // Check again: a failed write may have stopped tracing while we waited.
+  if (trace_file >= 0) {
+    TraceRecord* r = &trace_buffer[trace_count++];
+    *r = (TraceRecord){
+        .nanoseconds = (uint64_t)(GetMonotonicNanoseconds() - trace_start),
+        .object = (uint64_t)(uintptr_t)object,
+        .size = size,
+        .thread = trace_thread - 1,
+        .operation = (uint8_t)operation,
+        .alignment_shift =
+            alignment != 0 ? (uint8_t)__builtin_ctzll(alignment) : 0};
+    if (trace_count == sizeof(trace_buffer) / sizeof(trace_buffer[0])) {
+      flush_trace();
+    }
+  }
+  unlock_trace();
+  errno = e;
+}
+
+static void prepare_fork(void) {
+  lock_trace();
+  arena_set_prepare_fork(&set);
+}
+
+static void parent_after_fork(void) {
+  arena_set_parent_after_fork(&set);
+  unlock_trace();
+}
+
+// The child starts a trace of its own. The records still in the buffer are the
+// parent’s, and the parent will write them.
+static void child_after_fork(void) {
+  arena_set_child_after_fork(&set);
+  if (trace_file >= 0) {
+    stop_trace();
+    trace_count = 0;
+    open_trace();
+  }
+  unlock_trace();
+}
+
+// `pthread_atfork` may itself allocate, so we register the handlers only once
+// the set exists. Calls made before this runs are not traced.
+__attribute__((constructor)) static void initialize(void) {
+  get_set();
+  if (pthread_atfork(prepare_fork, parent_after_fork, child_after_fork)) {
+    abort();
+  }
+  trace_pattern = getenv("ARENA_TRACE");
+  if (trace_pattern != NULL) {
+    open_trace();
+  }
+}
+
+// Calls made after this runs (by later destructors, say) are not traced. Nor
+// are any buffered records written if the process ends by `_exit` or a signal.
+__attribute__((destructor)) static void finish_trace(void) {
+  lock_trace();
+  if (trace_file >= 0) {
+    flush_trace();
+  }
+  if (trace_file >= 0) {
+    stop_trace();
+  }
+  unlock_trace();
+}
+
+// Writes the heap profile, if `ARENA_PROFILE` asks for 1. Regions that later
+// destructors free still count as live.
+__attribute__((destructor)) static void write_profile(void) {
+  const char* pattern = getenv("ARENA_PROFILE");
+  char path[PATH_MAX];
+  if (pattern == NULL || !format_path(pattern, path)) {
+    return;
+  }
+  const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return;
+  }
+  arena_set_write_profile(get_set(), fd);
+  close(fd);
+}
+
+// `malloc(0)` must return either `NULL` or a unique pointer, but
+// `arena_malloc` rejects 0-byte requests. We allocate 1 byte instead.
+static size_t get_nonzero(size_t size) {
+  return size != 0 ? size : 1;
+}
+
+// The `malloc` family reports running out of memory, including requests too
+// large to represent, as `ENOMEM`. `arena_malloc` reports the latter as
+// `EINVAL`.
+static void* check_result(void* p) {
+  if (p == NULL) {
+    errno = ENOMEM;
+  }
+  return p;
+}
+
+static bool is_power_of_2(size_t n) {
+  return n != 0 && (n & (n - 1)) == 0;
+}
+
+void* malloc(size_t size) {
+  void* p = arena_set_malloc(get_set(), 1, get_nonzero(size));
+  if (p != NULL) {
+    record(trace_malloc, p, size, 0);
+  }
+  return check_result(p);
+}
+
+// We record a `free` before the region can be reused, and an allocation only
+// once it has happened, so that the trace never shows 1 address live twice.
+void free(void* p) {
+  if (p != NULL) {
+    record(trace_free, p, 0, 0);
+    arena_set_free(get_set(), p);
+  }
+}
+
+void* calloc(size_t count, size_t size) {
+  if (count == 0 || size == 0) {
+    count = size = 1;
+  }
+  void* p = arena_set_calloc(get_set(), count, size);
+  if (p != NULL) {
+    record(trace_calloc, p, count * size, 0);
+  }
+  return check_result(p);
+}
+
+void* realloc(void* p, size_t size) {
+  if (p != NULL && size == 0) {
+    free(p);
+    return NULL;
+  }
+  record(trace_realloc, p, size, 0);
+  void* q = arena_set_realloc(get_set(), p, 1, get_nonzero(size));
+  record(trace_realloc_result, q, size, 0);
+  return check_result(q);
+}
+
+void* reallocarray(void* p, size_t count, size_t size) {
+  size_t byte_count;
+  if (__builtin_mul_overflow(count, size, &byte_count)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return realloc(p, byte_count);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  if (!is_power_of_2(alignment)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  void* p =
+      arena_set_aligned_malloc(get_set(), alignment, 1, get_nonzero(size));
+  if (p != NULL) {
+    record(trace_aligned_malloc, p, size, alignment);
+  }
+  return check_result(p);
+}
+
+void* memalign(size_t alignment, size_t size) {
+  return aligned_alloc(alignment, size);
+}
+
+int posix_memalign(void** p, size_t alignment, size_t size) {
+  if (!is_power_of_2(alignment) || alignment % sizeof(void*) != 0) {
+    return EINVAL;
+  }
+  // `posix_memalign` reports errors by its return value, and must not change
+  // `errno`.
+  const int e = errno;
+  void* q = aligned_alloc(alignment, size);
+  if (q == NULL) {
+    errno = e;
+    return ENOMEM;
+  }
+  *p = q;
+  return 0;
+}
+
+void* valloc(size_t size) {
+  return aligned_alloc((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size) {
+  const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t byte_count;
+  if (__builtin_add_overflow(size, page_size - 1, &byte_count)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return aligned_alloc(page_size, byte_count - byte_count % page_size);
+}
+
+size_t malloc_usable_size(void* p) {
+  return p != NULL ? arena_get_usable_size(p) : 0;
+}
@@ -19,24 +19,60 @@ int arena_print(FILE* f, Arena* a) {
   }
 
   for (Chunk* c = a->chunk_list; c != NULL; c = c->next) {
-    const int x = fprintf(f, "Chunk %p: next: %p, size: %zu\n", (void*)c,
-                          (void*)c->next, c->byte_count);
+    const int x =
+        fprintf(f, "Chunk %p: next: %p, start: %p, size: %zu\n", (void*)c,
+                (void*)c->next, (void*)c->start, c->byte_count);
     if (x < 0 || add(r, x, &r)) {
       goto end;
     }
   }
 
-  for (Header* h = &(a->free_list); h != NULL; h = h->next) {
-    const int x = fprintf(f, "Header %p: next: %p, unit_count: %zu\n", (void*)h,
-                          (void*)h->next, h->unit_count);
+  for (Mapping* m = a->mappings; m != NULL; m = m->next) {
+    const Header* h = get_mapped_header(m);
+    const int x = fprintf(f, "Mapping %p: next: %p, unit_count: %zu\n",
+                          (void*)m, (void*)m->next, get_units(h));
     if (x < 0 || add(r, x, &r)) {
       goto end;
     }
-    if (h->next == &(a->free_list)) {
+  }
+
+  Header* const start = a->free_list_start;
+  for (Header* h = start; h != NULL; h = h->next) {
+    const int x = fprintf(
+        f, "Header %p: next: %p, previous: %p, unit_count: %zu, flags: %#zx\n",
+        (void*)h, (void*)h->next, (void*)get_previous(h), get_units(h),
+        h->unit_count & ~unit_count_mask);
+    if (x < 0 || add(r, x, &r)) {
+      goto end;
+    }
+    if (h->next == start) {
       break;
     }
   }
 
+  for (Header* h = tree_first(a->free_tree); h != NULL;
+       h = tree_next(a->free_tree, h)) {
+    const int x = fprintf(
+        f, "Tree %p: left: %p, right: %p, unit_count: %zu, flags: %#zx\n",
+        (void*)h, (void*)get_left(h), (void*)get_right(h), get_units(h),
+        h->unit_count & ~unit_count_mask);
+    if (x < 0 || add(r, x, &r)) {
+      goto end;
+    }
+  }
+
+  for (size_t i = 0; i < bin_count; i++) {
+    for (Header* h = a->bins[i]; h != NULL; h = h->next) {
+      const int x = fprintf(
+          f, "Bin %zu: Header %p: next: %p, unit_count: %zu, flags: %#zx\n", i,
+          (void*)h, (void*)h->next, get_units(h),
+          h->unit_count & ~unit_count_mask);
+      if (x < 0 || add(r, x, &r)) {
+        goto end;
+      }
+    }
+  }
+
 end:
   unlock(&(a->lock));
   return r;
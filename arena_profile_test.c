@@ -0,0 +1,138 @@
+// Copyright 2022 by [Chris Palmer](https://noncombatant.org)
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena_malloc.h"
+#include "get_utc_nanoseconds.h"
+
+static const char HelpMessage[] =
+    "Measures the cost of the heap profiler. It makes `allocation_count`\n"
+    "allocations of up to `allocation_size` bytes (writing to each), frees\n"
+    "every other one, and then writes a heap profile to /dev/null.\n"
+    "\n"
+    "`sample_bytes` is `ArenaOptions.sample_bytes`; 0 turns the profiler off.\n"
+    "The test reports how many regions were sampled, and compares the live\n"
+    "bytes that the samples imply (1 per `sample_bytes`) to the bytes that\n"
+    "are really live.\n"
+    "\n"
+    "Then it checks that a failed `arena_realloc` keeps the region's sample,\n"
+    "and that once every region has been reallocated and freed, no samples\n"
+    "are left.\n"
+    "\n"
+    "Usage: arena_profile_test sample_bytes allocation_count "
+    "allocation_size\n";
+
+static uint64_t random_state = 1;
+
+// xorshift64, so that every platform sees the same sizes.
+static uint64_t get_random(void) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return random_state;
+}
+
+static noreturn void help() {
+  fprintf(stderr, HelpMessage);
+  exit(1);
+}
+
+int main(int count, char* arguments[]) {
+  if (count != 4) {
+    help();
+  }
+  const size_t sample_bytes = strtoul(arguments[1], NULL, 0);
+  const size_t allocation_count = strtoul(arguments[2], NULL, 0);
+  const size_t allocation_size = strtoul(arguments[3], NULL, 0);
+  if (allocation_count == 0 || allocation_size == 0) {
+    help();
+  }
+
+  char** allocations = calloc(allocation_count, sizeof(char*));
+  if (allocations == NULL) {
+    printf("%s\n", strerror(errno));
+    return errno;
+  }
+  Arena a;
+  arena_create_with_options(&a, &(ArenaOptions){.sample_bytes = sample_bytes});
+  size_t live_bytes = 0;
+  const int64_t start = GetMonotonicNanoseconds();
+  for (size_t i = 0; i < allocation_count; i++) {
+    const size_t size = 1 + get_random() % allocation_size;
+    allocations[i] = arena_malloc(&a, 1, size);
+    if (allocations[i] == NULL) {
+      printf("%s\n", strerror(errno));
+      return errno;
+    }
+    memset(allocations[i], 1, size);
+    if (i % 2 != 0) {
+      live_bytes += size;
+    }
+  }
+  for (size_t i = 0; i < allocation_count; i += 2) {
+    arena_free(&a, allocations[i]);
+  }
+  const int64_t end = GetMonotonicNanoseconds();
+
+  const int fd = open("/dev/null", O_WRONLY);
+  const int64_t write_start = GetMonotonicNanoseconds();
+  if (fd < 0 || !arena_write_profile(&a, fd)) {
+    printf("%s\n", strerror(errno));
+    return errno;
+  }
+  const int64_t write_end = GetMonotonicNanoseconds();
+  close(fd);
+
+  ArenaStats stats;
+  arena_get_stats(&a, &stats);
+  printf("sample bytes %zu: ns per operation: %.1f, samples: %zu, "
+         "profile written in %.1f ms",
+         sample_bytes,
+         (double)(end - start) / (double)(allocation_count * 3 / 2),
+         stats.sample_count, (double)(write_end - write_start) / 1e6);
+  if (sample_bytes != 0) {
+    printf(", estimated live: %zu KiB, live: %zu KiB",
+           stats.sample_count * sample_bytes / 1024, live_bytes / 1024);
+  }
+  printf("\n");
+
+  // `count * size` overflows, so these fail and change nothing.
+  const size_t sample_count = stats.sample_count;
+  for (size_t i = 1; i < allocation_count; i += 2) {
+    if (arena_realloc(&a, allocations[i], SIZE_MAX, 2) != NULL) {
+      printf("an overflowing arena_realloc succeeded\n");
+      return 1;
+    }
+  }
+  arena_get_stats(&a, &stats);
+  if (stats.sample_count != sample_count) {
+    printf("failed reallocs lost %zu samples\n",
+           sample_count - stats.sample_count);
+    return 1;
+  }
+  for (size_t i = 1; i < allocation_count; i += 2) {
+    const size_t size = 1 + get_random() % allocation_size;
+    allocations[i] = arena_realloc(&a, allocations[i], 1, size);
+    if (allocations[i] == NULL) {
+      printf("%s\n", strerror(errno));
+      return errno;
+    }
+    arena_free(&a, allocations[i]);
+  }
+  arena_get_stats(&a, &stats);
+  if (stats.sample_count != 0) {
+    printf("%zu samples outlived their regions\n", stats.sample_count);
+    return 1;
+  }
+
+  arena_destroy(&a);
+  free(allocations);
+}
@@ -0,0 +1,116 @@
+// Copyright 2022 by [Chris Palmer](https://noncombatant.org)
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#include "arena_malloc.h"
+#include "get_utc_nanoseconds.h"
+
+static const char HelpMessage[] =
+    "Benchmarks append-heavy vector growth. `vector_count` vectors of\n"
+    "`size_t` grow in lock step, 1 element at a time, until each holds\n"
+    "`length` elements. When a vector is full, its capacity grows by\n"
+    "`growth_percent` percent (at least 1 element), either with\n"
+    "`arena_realloc` or with `arena_malloc`, `memcpy`, and `arena_free`.\n"
+    "\n"
+    "Usage: arena_realloc_test vector_count length growth_percent\n";
+
+typedef struct Vector {
+  size_t* elements;
+  size_t length;
+  size_t capacity;
+} Vector;
+
+static size_t vector_count;
+static size_t length;
+static size_t growth_percent;
+
+static size_t grow(size_t capacity) {
+  const size_t more = capacity * growth_percent / 100;
+  return capacity + (more > 0 ? more : 1);
+}
+
+static void check(void* p) {
+  if (p == NULL) {
+    printf("%s\n", strerror(errno));
+    exit(errno);
+  }
+}
+
+static void run(Vector* vectors, Arena* a, bool use_realloc) {
+  size_t in_place = 0, resizes = 0;
+  const int64_t start = GetUTCNanoseconds();
+
+  for (size_t i = 0; i < length; i++) {
+    for (size_t j = 0; j < vector_count; j++) {
+      Vector* v = &vectors[j];
+      if (v->length == v->capacity) {
+        const size_t capacity = grow(v->capacity);
+        size_t* e;
+        if (use_realloc) {
+          e = arena_realloc(a, v->elements, capacity, sizeof(size_t));
+          check(e);
+        } else {
+          e = arena_malloc(a, capacity, sizeof(size_t));
+          check(e);
+          if (v->elements != NULL) {
+            memcpy(e, v->elements, v->length * sizeof(size_t));
+            arena_free(a, v->elements);
+          }
+        }
+        in_place += e == v->elements;
+        resizes++;
+        v->elements = e;
+        v->capacity = capacity;
+      }
+      v->elements[v->length++] = i;
+    }
+  }
+
+  const int64_t end = GetUTCNanoseconds();
+  for (size_t j = 0; j < vector_count; j++) {
+    Vector* v = &vectors[j];
+    for (size_t i = 0; i < length; i++) {
+      if (v->elements[i] != i) {
+        printf("vector %zu is corrupt at %zu\n", j, i);
+        exit(1);
+      }
+    }
+    arena_free(a, v->elements);
+  }
+  printf("%-22s ns per append: %" PRId64 ", resizes: %zu, in place: %zu\n",
+         use_realloc ? "arena_realloc:" : "arena_malloc + memcpy:",
+         (end - start) / (int64_t)(length * vector_count), resizes, in_place);
+}
+
+static noreturn void help() {
+  fprintf(stderr, HelpMessage);
+  exit(1);
+}
+
+int main(int count, char* arguments[]) {
+  if (count != 4) {
+    help();
+  }
+  vector_count = strtoul(arguments[1], NULL, 0);
+  length = strtoul(arguments[2], NULL, 0);
+  growth_percent = strtoul(arguments[3], NULL, 0);
+  if (vector_count == 0 || length == 0) {
+    help();
+  }
+
+  for (int use_realloc = 0; use_realloc < 2; use_realloc++) {
+    Arena a;
+    arena_create(&a, default_minimum_chunk_units);
+    Vector* vectors = calloc(vector_count, sizeof(Vector));
+    check(vectors);
+    run(vectors, &a, use_realloc);
+    free(vectors);
+    arena_destroy(&a);
+  }
+}
@@ -0,0 +1,446 @@
+// Copyright 2022 by [Chris Palmer](https://noncombatant.org)
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "arena_malloc.h"
+#include "arena_trace.h"
+#include "get_utc_nanoseconds.h"
+#include "modern_kr_malloc.h"
+
+static const char HelpMessage[] =
+    "Replays a trace recorded by libarena_malloc.so (see arena_preload.c)\n"
+    "against an allocator, and reports its throughput, its peak resident\n"
+    "set size, and its fragmentation (peak RSS divided by the peak number\n"
+    "of bytes the trace had live). Every page of each region is touched,\n"
+    "as the traced program presumably did.\n"
+    "\n"
+    "`allocator` is \"arena\", \"modern\", or \"system\". Run each in its own\n"
+    "process, since the peak RSS is per process.\n"
+    "\n"
+    "The calls are replayed as fast as possible, in the order they were\n"
+    "recorded, from 1 thread. `modern` has no aligned allocation, so it\n"
+    "ignores alignment (but allocates the same number of bytes).\n"
+    "\n"
+    "Usage: arena_replay allocator trace\n";
+
+// A trace record, with its object addresses replaced by small integer IDs
+// (which are reused once their objects are freed). That lets the replay keep
+// its live objects in a plain array, and keeps the work of looking addresses
+// up out of the timing.
+typedef struct Operation {
+  uint64_t size;
+  uint32_t id;
+
+  // For `trace_realloc`, the old object’s ID (or `no_id`).
+  uint32_t old_id;
+
+  uint8_t operation;
+  uint8_t alignment_shift;
+} Operation;
+
+enum { no_id = UINT32_MAX };
+
+typedef enum Allocator {
+  allocator_arena,
+  allocator_modern,
+  allocator_system,
+} Allocator;
+
+// Maps trace addresses to IDs, with open addressing. Entries are never
+// removed: an address that is freed keeps its slot (with `no_id`) until it is
+// allocated again, so the table never needs more slots than the trace has
+// distinct addresses.
+typedef struct AddressMap {
+  uint64_t* addresses;
+  uint32_t* ids;
+  size_t mask;
+} AddressMap;
+
+// A `realloc` that has started but not yet finished.
+typedef struct Pending {
+  uint64_t address;
+  uint32_t id;
+} Pending;
+
+static noreturn void help(void) {
+  fprintf(stderr, HelpMessage);
+  exit(1);
+}
+
+static noreturn void die(const char* message) {
+  fprintf(stderr, "%s: %s\n", message, strerror(errno));
+  exit(1);
+}
+
+// Returns the process’ peak RSS, in bytes. On Linux, that is `VmHWM`, which
+// `reset_peak_rss` can reset. (`getrusage`’s `ru_maxrss` is no use there: it
+// is the larger of `VmHWM` and the peak that the process had before it called
+// `exec`, which nothing resets, so it usually hides the replay’s own peak.)
+static size_t get_peak_rss(void) {
+#if defined(__linux__)
+  FILE* f = fopen("/proc/self/status", "r");
+  if (f != NULL) {
+    char line[256];
+    size_t kib;
+    while (fgets(line, sizeof(line), f) != NULL) {
+      if (sscanf(line, "VmHWM: %zu kB", &kib) == 1) {
+        fclose(f);
+        return kib * 1024;
+      }
+    }
+    fclose(f);
+  }
+#endif
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage)) {
+    return 0;
+  }
+#if defined(__APPLE__)
+  return (size_t)usage.ru_maxrss;
+#else
+  return (size_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+// The peak RSS includes the memory that reading the trace took, which the
+// replay itself never needs. On Linux, we reset the peak to the current RSS
+// once that memory has been freed. Elsewhere, the peak can’t be reset, and
+// includes whatever the process (or, with `ru_maxrss`, the process that
+// `exec`ed it) used before the replay, so the results may show too little
+// RSS, or none, for traces with few live bytes.
+static void reset_peak_rss(void) {
+  FILE* f = fopen("/proc/self/clear_refs", "w");
+  if (f != NULL) {
+    fputs("5", f);
+    fclose(f);
+  }
+}
+
+static void touch_pages(char* p, size_t byte_count) {
+  for (size_t i = 0; i < byte_count; i += 4096) {
+    p[i] = 1;
+  }
+  if (byte_count != 0) {
+    p[byte_count - 1] = 1;
+  }
+}
+
+static TraceRecord* read_trace(const char* pathname, size_t* count) {
+  FILE* f = fopen(pathname, "rb");
+  if (f == NULL) {
+    die(pathname);
+  }
+  TraceHeader header;
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TRACE_VERSION ||
+      header.record_size != sizeof(TraceRecord)) {
+    fprintf(stderr, "%s: not a version %d trace\n", pathname, TRACE_VERSION);
+    exit(1);
+  }
+
+  size_t capacity = 1 << 16;
+  *count = 0;
+  TraceRecord* records = NULL;
+  while (true) {
+    records = realloc(records, capacity * sizeof(TraceRecord));
+    if (records == NULL) {
+      die("realloc");
+    }
+    *count +=
+        fread(&records[*count], sizeof(TraceRecord), capacity - *count, f);
+    if (*count < capacity) {
+      break;
+    }
+    capacity *= 2;
+  }
+  if (ferror(f)) {
+    die(pathname);
+  }
+  fclose(f);
+  return records;
+}
+
+static uint32_t* find(AddressMap* m, uint64_t address) {
+  size_t i = (size_t)((address >> 4) * 0x9e3779b97f4a7c15) & m->mask;
+  while (m->addresses[i] != 0 && m->addresses[i] != address) {
+    i = (i + 1) & m->mask;
+  }
+  m->addresses[i] = address;
+  return &m->ids[i];
+}
+
+// Turns `records` into `Operation`s, and returns how many there are. Frees of
+// addresses that the trace never allocated (because they were allocated
+// before tracing began) are dropped, as are failed `realloc`s.
+static size_t get_operations(const TraceRecord* records, size_t record_count,
+                             Operation* operations, size_t* id_count) {
+  size_t capacity = 16;
+  while (capacity < 2 * record_count) {
+    capacity *= 2;
+  }
+  AddressMap map = {.addresses = calloc(capacity, sizeof(uint64_t)),
+                    .ids = malloc(capacity * sizeof(uint32_t)),
+                    .mask = capacity - 1};
+  // `free_ids` is a stack of IDs that can be reused. Threads’ pending
+  // `realloc`s are in `pending`, indexed by thread.
+  uint32_t* free_ids = malloc(record_count * sizeof(uint32_t) + 1);
+  size_t free_id_count = 0;
+  size_t pending_count = 0;
+  Pending* pending = NULL;
+  if (map.addresses == NULL || map.ids == NULL || free_ids == NULL) {
+    die("malloc");
+  }
+  memset(map.ids, 0xff, capacity * sizeof(uint32_t));
+
+  uint32_t next_id = 0;
+  size_t count = 0;
+  for (size_t i = 0; i < record_count; i++) {
+    const TraceRecord* r = &records[i];
+    if (r->thread >= pending_count) {
+      const size_t old_count = pending_count;
+      pending_count = 2 * (size_t)r->thread + 2;
+      pending = realloc(pending, pending_count * sizeof(Pending));
+      if (pending == NULL) {
+        die("realloc");
+      }
+      for (size_t j = old_count; j < pending_count; j++) {
+        pending[j] = (Pending){.id = no_id};
+      }
+    }
+
+    uint32_t* id = r->object != 0 ? find(&map, r->object) : NULL;
+    Operation* o = &operations[count];
+    *o = (Operation){.size = r->size,
+                     .id = no_id,
+                     .old_id = no_id,
+                     .operation = r->operation,
+                     .alignment_shift = r->alignment_shift};
+    switch (r->operation) {
+      case trace_malloc:
+      case trace_calloc:
+      case trace_aligned_malloc:
+        o->id = *id =
+            free_id_count != 0 ? free_ids[--free_id_count] : next_id++;
+        count++;
+        break;
+      case trace_free:
+        if (*id != no_id) {
+          o->id = *id;
+          free_ids[free_id_count++] = *id;
+          *id = no_id;
+          count++;
+        }
+        break;
+      case trace_realloc:
+        // Until the result comes, the old object belongs to the `realloc`, and
+        // its address may be reused by other threads.
+        pending[r->thread] = (Pending){.address = r->object, .id = no_id};
+        if (id != NULL) {
+          pending[r->thread].id = *id;
+          *id = no_id;
+        }
+        break;
+      case trace_realloc_result: {
+        Pending* old = &pending[r->thread];
+        if (id == NULL) {
+          // The `realloc` failed, so the old object (if any) is still live at
+          // its old address.
+          if (old->id != no_id) {
+            *find(&map, old->address) = old->id;
+          }
+        } else {
+          o->operation = trace_realloc;
+          o->old_id = old->id;
+          o->id = *id = old->id != no_id     ? old->id
+                        : free_id_count != 0 ? free_ids[--free_id_count]
+                                             : next_id++;
+          count++;
+        }
+        old->id = no_id;
+        break;
+      }
+      default:
+        fprintf(stderr, "unknown operation %d\n", r->operation);
+        exit(1);
+    }
+  }
+
+  free(map.addresses);
+  free(map.ids);
+  free(free_ids);
+  free(pending);
+  *id_count = next_id;
+  return count;
+}
+
+int main(int count, char* arguments[]) {
+  if (count != 3) {
+    help();
+  }
+  Allocator allocator;
+  if (strcmp(arguments[1], "arena") == 0) {
+    allocator = allocator_arena;
+  } else if (strcmp(arguments[1], "modern") == 0) {
+    allocator = allocator_modern;
+  } else if (strcmp(arguments[1], "system") == 0) {
+    allocator = allocator_system;
+  } else {
+    help();
+  }
+
+  size_t record_count;
+  TraceRecord* records = read_trace(arguments[2], &record_count);
+  Operation* operations = malloc(record_count * sizeof(Operation) + 1);
+  if (operations == NULL) {
+    die("malloc");
+  }
+  size_t id_count;
+  const size_t operation_count =
+      get_operations(records, record_count, operations, &id_count);
+  uint32_t thread_count = 0;
+  for (size_t i = 0; i < record_count; i++) {
+    if (records[i].thread >= thread_count) {
+      thread_count = records[i].thread + 1;
+    }
+  }
+  const uint64_t duration =
+      record_count != 0 ? records[record_count - 1].nanoseconds : 0;
+  free(records);
+
+  char** objects = calloc(id_count + 1, sizeof(char*));
+  uint64_t* sizes = calloc(id_count + 1, sizeof(uint64_t));
+  if (objects == NULL || sizes == NULL) {
+    die("calloc");
+  }
+  touch_pages((char*)objects, (id_count + 1) * sizeof(char*));
+  touch_pages((char*)sizes, (id_count + 1) * sizeof(uint64_t));
+  reset_peak_rss();
+  const size_t baseline_rss = get_peak_rss();
+
+  Arena a;
+  if (allocator == allocator_arena) {
+    arena_create(&a, default_minimum_chunk_units);
+  }
+  size_t live_bytes = 0, peak_live_bytes = 0;
+  const int64_t start = GetMonotonicNanoseconds();
+
+  for (size_t i = 0; i < operation_count; i++) {
+    const Operation* o = &operations[i];
+    // The allocators disagree about 0-byte requests, so we make them all
+    // allocate 1 byte, like libarena_malloc.so does.
+    const size_t size = o->size != 0 ? (size_t)o->size : 1;
+    const size_t alignment = (size_t)1 << o->alignment_shift;
+    char* p = NULL;
+    switch (o->operation) {
+      case trace_malloc:
+        p = allocator == allocator_arena    ? arena_malloc(&a, 1, size)
+            : allocator == allocator_modern ? kr_malloc(1, size)
+                                            : malloc(size);
+        break;
+      case trace_calloc:
+        if (allocator == allocator_arena) {
+          p = arena_calloc(&a, 1, size);
+        } else if (allocator == allocator_modern) {
+          p = kr_malloc(1, size);
+          if (p != NULL) {
+            memset(p, 0, size);
+          }
+        } else {
+          p = calloc(1, size);
+        }
+        break;
+      case trace_aligned_malloc:
+        if (allocator == allocator_arena) {
+          p = arena_aligned_malloc(&a, alignment, 1, size);
+        } else if (allocator == allocator_modern) {
+          p = kr_malloc(1, size);
+        } else {
+          void* q = NULL;
+          posix_memalign(&q, alignment < sizeof(void*) ? sizeof(void*)
+                                                       : alignment,
+                         size);
+          p = q;
+        }
+        break;
+      case trace_free:
+        if (allocator == allocator_arena) {
+          arena_free(&a, objects[o->id]);
+        } else if (allocator == allocator_modern) {
+          kr_free(objects[o->id]);
+        } else {
+          free(objects[o->id]);
+        }
+        live_bytes -= sizes[o->id];
+        objects[o->id] = NULL;
+        sizes[o->id] = 0;
+        continue;
+      case trace_realloc: {
+        char* old = o->old_id != no_id ? objects[o->old_id] : NULL;
+        const size_t old_size = o->old_id != no_id ? sizes[o->old_id] : 0;
+        if (allocator == allocator_arena) {
+          p = arena_realloc(&a, old, 1, size);
+        } else if (allocator == allocator_modern) {
+          p = kr_malloc(1, size);
+          if (p != NULL && old != NULL) {
+            memcpy(p, old, old_size < size ? old_size : size);
+            kr_free(old);
+          }
+        } else {
+          p = realloc(old, size);
+        }
+        if (p == NULL) {
+          die("realloc");
+        }
+        // Only the new bytes need touching.
+        if (size > old_size) {
+          touch_pages(p + old_size, size - old_size);
+        }
+        objects[o->id] = p;
+        sizes[o->id] = size;
+        live_bytes += size - old_size;
+        if (live_bytes > peak_live_bytes) {
+          peak_live_bytes = live_bytes;
+        }
+        continue;
+      }
+    }
+    if (p == NULL) {
+      die("malloc");
+    }
+    touch_pages(p, size);
+    objects[o->id] = p;
+    sizes[o->id] = size;
+    live_bytes += size;
+    if (live_bytes > peak_live_bytes) {
+      peak_live_bytes = live_bytes;
+    }
+  }
+
+  const int64_t end = GetMonotonicNanoseconds();
+  const size_t peak_rss = get_peak_rss() - baseline_rss;
+  printf("%s: %zu operations from %" PRIu32 " threads over %" PRIu64
+         " ms\n",
+         arguments[2], operation_count, thread_count, duration / 1000000);
+  printf("%s: ns per operation: %" PRId64
+         ", peak live: %zu KiB, peak RSS: %zu KiB (%.2fx)\n",
+         arguments[1],
+         operation_count != 0 ? (end - start) / (int64_t)operation_count : 0,
+         peak_live_bytes / 1024, peak_rss / 1024,
+         peak_live_bytes != 0 ? (double)peak_rss / (double)peak_live_bytes
+                              : 0.0);
+
+  if (allocator == allocator_arena) {
+    arena_destroy(&a);
+  }
+  free(objects);
+  free(sizes);
+  free(operations);
+}
@@ -5,6 +5,8 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdnoreturn.h>
@@ -15,8 +17,8 @@
 
 static const char HelpMessage[] =
     "Benchmarks the allocator, allowing the caller to set the number of\n"
-    "allocations per thread, the number of threads, and the size of each\n"
-    "allocation.\n"
+    "operations per thread, the number of threads, the size of each\n"
+    "allocation, and the scenario to run.\n"
     "\n"
     "You can make the allocation size random per allocation by setting it\n"
     "to \"r\", immediately followed by a seed value for the random number\n"
@@ -24,14 +26,114 @@ static const char HelpMessage[] =
     "maximum allocation size is set by an internal constant (currently\n"
     "%zu).\n"
     "\n"
-    "Usage: arena_threads_test iterations thread_count allocation_size"
-    "\n";
+    "The optional 4th argument is a string of option letters (or \"-\" for\n"
+    "none):\n"
+    "\n"
+    "  c  enable the per-thread cache (`ArenaOptions.thread_cache`)\n"
+    "  t  use a ticket lock (`arena_lock_ticket`)\n"
+    "  s  use a spin lock (`arena_lock_spin`)\n"
+    "  r  use region mode (`ArenaOptions.region`)\n"
+    "  p  give each thread an arena of its own, rather than sharing 1\n"
+    "  u  use 1 arena per CPU (`ArenaSet`), rather than sharing 1\n"
+    "  q  free regions from arenas that the thread does not own without\n"
+    "     taking the arenas' locks (`ArenaOptions.remote_frees`)\n"
+    "  w  reserve and pre-fault enough memory for the run before it starts\n"
+    "     (`arena_reserve`; not with u)\n"
+    "  o  free in a random order, rather than in allocation order\n"
+    "  l  free in reverse allocation order (LIFO)\n"
+    "  j  print the results as 1 line of JSON\n"
+    "\n"
+    "The optional 5th argument is the scenario:\n"
+    "\n"
+    "  batch     each thread allocates `iterations` regions, and then frees\n"
+    "            them all (the default)\n"
+    "  producer  each thread allocates `iterations` regions and passes\n"
+    "            them to the next thread, which frees them\n"
+    "  larson    each thread replaces random regions in a set of %zu, for\n"
+    "            `iterations` operations, in %zu rounds; between rounds,\n"
+    "            the sets move to other threads, so threads free regions\n"
+    "            that other threads allocated\n"
+    "\n"
+    "Every `arena_malloc` and `arena_free` is timed with a monotonic clock,\n"
+    "and the results show the percentiles of each. Reading the clock takes\n"
+    "time, too, which the throughput includes.\n"
+    "\n"
+    "Usage: arena_threads_test iterations thread_count allocation_size "
+    "[options [scenario]]\n";
+
+enum {
+  larson_slot_count = 1000,
+  larson_round_count = 10,
+  ring_capacity = 1024,
+};
+
+static const size_t maximum_allocation_size = 0xFFFFUL;
+
+// A histogram of latencies in nanoseconds. Values below 8 have buckets of
+// their own; above that, each power of 2 has 8 buckets, so a bucket’s bounds
+// are within 12.5% of each other.
+enum {
+  histogram_sub_bucket_count = 8,
+  histogram_bucket_count = 64 * histogram_sub_bucket_count,
+};
+
+typedef struct Histogram {
+  uint64_t counts[histogram_bucket_count];
+  uint64_t count;
+  uint64_t maximum;
+} Histogram;
+
+typedef enum Scenario {
+  scenario_batch,
+  scenario_producer,
+  scenario_larson,
+} Scenario;
+
+typedef enum FreeOrder {
+  order_fifo,
+  order_lifo,
+  order_random,
+} FreeOrder;
+
+// A single-producer, single-consumer queue of regions, for `scenario_producer`.
+typedef struct Ring {
+  _Alignas(64) atomic_size_t head;
+  _Alignas(64) atomic_size_t tail;
+  atomic_bool done;
+  void* regions[ring_capacity];
+} Ring;
+
+// A region in a larson set, and the arena it came from.
+typedef struct Slot {
+  void* p;
+  Arena* arena;
+} Slot;
+
+typedef struct Worker {
+  size_t index;
+  pthread_t thread;
+  Arena* arena;
+  uint64_t random_state;
+  Histogram mallocs;
+  Histogram frees;
+} Worker;
 
 static size_t iterations;
 static size_t thread_count;
 static size_t allocation_size;
-static const size_t maximum_allocation_size = 0xFFFFUL;
-static Arena a;
+static Scenario scenario;
+static FreeOrder free_order;
+static bool per_thread_arenas;
+static bool use_arena_set;
+static bool reserve;
+static ArenaSet arena_set;
+static ArenaOptions arena_options;
+static Arena shared_arena;
+static Arena* arenas;
+static Worker* workers;
+static Ring* rings;
+static Slot* larson_sets;
+static pthread_barrier_t barrier;
 
 // Touch every page to ensure the benchmark doesn’t get noisier than it already
 // is due to lazy commitment/page faults.
@@ -42,78 +144,483 @@ static void touch_pages(void* p, size_t byte_count) {
   }
 }
 
-static void* allocate_lots(void* _) {
-  (void)_;
-  const size_t iterations_size = iterations * sizeof(char*);
-  char** ps = malloc(iterations_size);
+// xorshift64, so that threads do not share (or lock) `rand`’s state.
+static uint64_t get_random(Worker* w) {
+  w->random_state ^= w->random_state << 13;
+  w->random_state ^= w->random_state >> 7;
+  w->random_state ^= w->random_state << 17;
+  return w->random_state;
+}
+
+static size_t get_size(Worker* w) {
+  if (allocation_size != 0) {
+    return allocation_size;
+  }
+  return 1 + get_random(w) % maximum_allocation_size;
+}
+
+// With `reserve`, reserves about as much memory as the regions of the
+// `user_count` threads that use `a` will need at once, so that the run doesn’t
+// wait for the platform.
+static void reserve_memory(Arena* a, size_t user_count) {
+  if (!reserve) {
+    return;
+  }
+  const size_t size =
+      allocation_size != 0 ? allocation_size : maximum_allocation_size / 2;
+  const size_t byte_count = user_count * iterations * (size + 16);
+  if (!arena_reserve(a, byte_count, arena_reserve_populate)) {
+    err(errno, "Could not reserve memory\n");
+  }
+}
+
+static size_t get_bucket(uint64_t n) {
+  if (n < histogram_sub_bucket_count) {
+    return n;
+  }
+  const size_t e = 63 - (size_t)__builtin_clzll(n);
+  return (e - 2) * histogram_sub_bucket_count +
+         (size_t)((n >> (e - 3)) & (histogram_sub_bucket_count - 1));
+}
+
+// Returns the smallest value that falls in bucket `b`.
+static uint64_t get_bucket_start(size_t b) {
+  if (b < histogram_sub_bucket_count) {
+    return b;
+  }
+  const size_t e = b / histogram_sub_bucket_count + 2;
+  return (histogram_sub_bucket_count + b % histogram_sub_bucket_count)
+         << (e - 3);
+}
+
+static void record(Histogram* h, int64_t start, int64_t end) {
+  const uint64_t n = (uint64_t)(end - start);
+  h->counts[get_bucket(n)]++;
+  h->count++;
+  if (n > h->maximum) {
+    h->maximum = n;
+  }
+}
+
+static void merge(Histogram* into, const Histogram* h) {
+  for (size_t i = 0; i < histogram_bucket_count; i++) {
+    into->counts[i] += h->counts[i];
+  }
+  into->count += h->count;
+  if (h->maximum > into->maximum) {
+    into->maximum = h->maximum;
+  }
+}
+
+// Returns an upper bound on the `fraction` quantile of `h`: the end of the
+// bucket that holds it.
+static uint64_t get_percentile(const Histogram* h, double fraction) {
+  const uint64_t rank = (uint64_t)(fraction * (double)h->count);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < histogram_bucket_count; i++) {
+    seen += h->counts[i];
+    if (seen > rank) {
+      const uint64_t end = get_bucket_start(i + 1) - 1;
+      return end < h->maximum ? end : h->maximum;
+    }
+  }
+  return h->maximum;
+}
+
+// Allocates from `a`, or from the CPU’s arena if we are using an `ArenaSet`.
+static void* allocate(Arena* a, size_t size) {
+  return use_arena_set ? arena_set_malloc(&arena_set, size, 1)
+                       : arena_malloc(a, size, 1);
+}
+
+static void release(Arena* a, void* p) {
+  if (use_arena_set) {
+    arena_set_free(&arena_set, p);
+  } else {
+    arena_free(a, p);
+  }
+}
+
+static void* timed_malloc(Worker* w, Arena* a) {
+  const size_t size = get_size(w);
+  const int64_t start = GetMonotonicNanoseconds();
+  void* p = allocate(a, size);
+  record(&(w->mallocs), start, GetMonotonicNanoseconds());
+  if (p == NULL) {
+    printf("%s\n", strerror(errno));
+    exit(errno);
+  }
+  return p;
+}
+
+static void timed_free(Worker* w, Arena* a, void* p) {
+  const int64_t start = GetMonotonicNanoseconds();
+  release(a, p);
+  record(&(w->frees), start, GetMonotonicNanoseconds());
+}
+
+static void run_batch(Worker* w) {
+  const size_t iterations_size = iterations * sizeof(void*);
+  void** ps = malloc(iterations_size);
   touch_pages(ps, iterations_size);
+  pthread_barrier_wait(&barrier);
 
-  const int64_t start = GetUTCNanoseconds();
+  for (size_t i = 0; i < iterations; i++) {
+    ps[i] = timed_malloc(w, w->arena);
+  }
+  if (free_order == order_random) {
+    for (size_t i = iterations - 1; i > 0; i--) {
+      const size_t j = get_random(w) % (i + 1);
+      void* p = ps[i];
+      ps[i] = ps[j];
+      ps[j] = p;
+    }
+  }
+  for (size_t i = 0; i < iterations; i++) {
+    timed_free(w, w->arena,
+               ps[free_order == order_lifo ? iterations - 1 - i : i]);
+  }
+  free(ps);
+}
 
-  for (size_t i = 1; i < iterations; i++) {
-    size_t s = allocation_size;
-    if (s == 0) {
-      s = (unsigned)rand() % maximum_allocation_size;
+static bool push(Ring* r, void* p) {
+  const size_t tail = atomic_load_explicit(&(r->tail), memory_order_relaxed);
+  if (tail - atomic_load_explicit(&(r->head), memory_order_acquire) ==
+      ring_capacity) {
+    return false;
+  }
+  r->regions[tail % ring_capacity] = p;
+  atomic_store_explicit(&(r->tail), tail + 1, memory_order_release);
+  return true;
+}
+
+static void* pop(Ring* r) {
+  const size_t head = atomic_load_explicit(&(r->head), memory_order_relaxed);
+  if (head == atomic_load_explicit(&(r->tail), memory_order_acquire)) {
+    return NULL;
+  }
+  void* p = r->regions[head % ring_capacity];
+  atomic_store_explicit(&(r->head), head + 1, memory_order_release);
+  return p;
+}
+
+// Each thread sends its regions to the next thread, and frees the ones that
+// the previous thread sends it. With 1 thread, it frees its own.
+static void run_producer(Worker* w) {
+  Ring* out = &rings[w->index];
+  const size_t previous = (w->index + thread_count - 1) % thread_count;
+  Ring* in = &rings[previous];
+  Arena* in_arena = workers[previous].arena;
+  pthread_barrier_wait(&barrier);
+
+  for (size_t i = 0; i < iterations; i++) {
+    void* p = timed_malloc(w, w->arena);
+    // While our consumer is behind, we keep up with our producer, so that
+    // nobody waits for anybody forever. If there is nothing to do, we let the
+    // others run, in case there are more threads than CPUs.
+    while (!push(out, p)) {
+      void* q = pop(in);
+      if (q != NULL) {
+        timed_free(w, in_arena, q);
+      } else {
+        sched_yield();
+      }
+    }
+    void* q = pop(in);
+    if (q != NULL) {
+      timed_free(w, in_arena, q);
     }
-    char* p = arena_malloc(&a, s, 1);
-    ps[i] = p;
-    if (p == NULL) {
+  }
+  atomic_store_explicit(&(out->done), true, memory_order_release);
+  while (true) {
+    const bool done = atomic_load_explicit(&(in->done), memory_order_acquire);
+    void* q = pop(in);
+    if (q != NULL) {
+      timed_free(w, in_arena, q);
+    } else if (done) {
+      break;
+    } else {
+      sched_yield();
+    }
+  }
+}
+
+// Like the Larson benchmark (Larson and Krishnan, “Memory Allocation for
+// Long-Running Server Applications”), where threads exit and new threads
+// inherit their regions, except that here the sets move between threads that
+// keep running.
+static void run_larson(Worker* w) {
+  Slot* set = &larson_sets[w->index * larson_slot_count];
+  for (size_t i = 0; i < larson_slot_count; i++) {
+    set[i] = (Slot){.p = allocate(w->arena, get_size(w)),
+                    .arena = w->arena};
+    if (set[i].p == NULL) {
       printf("%s\n", strerror(errno));
       exit(errno);
     }
   }
+  pthread_barrier_wait(&barrier);
 
-  const int64_t after_allocations = GetUTCNanoseconds();
-
-  for (size_t i = 1; i < iterations; i++) {
-    arena_free(&a, ps[i]);
+  const size_t round_iterations = iterations / larson_round_count;
+  for (size_t r = 0; r < larson_round_count; r++) {
+    set = &larson_sets[(w->index + r) % thread_count * larson_slot_count];
+    for (size_t i = 0; i < round_iterations; i++) {
+      Slot* s = &set[get_random(w) % larson_slot_count];
+      timed_free(w, s->arena, s->p);
+      *s = (Slot){.p = timed_malloc(w, w->arena), .arena = w->arena};
+    }
+    // Every thread must finish with its set before any other takes it.
+    pthread_barrier_wait(&barrier);
   }
+}
 
-  const int64_t end = GetUTCNanoseconds();
-  printf("ns per malloc: %'" PRId64 ", ns per free: %'" PRId64 "\n",
-         (uint64_t)(after_allocations - start) / iterations * thread_count,
-         (uint64_t)(end - after_allocations) / iterations * thread_count);
+static void* run(void* p) {
+  Worker* w = p;
+  // The thread that creates an arena owns it (see
+  // `ArenaOptions.remote_frees`), so each thread creates its own.
+  if (per_thread_arenas) {
+    arena_create_with_options(w->arena, &arena_options);
+    reserve_memory(w->arena, 1);
+  }
+  switch (scenario) {
+    case scenario_batch:
+      run_batch(w);
+      break;
+    case scenario_producer:
+      run_producer(w);
+      break;
+    case scenario_larson:
+      run_larson(w);
+      break;
+  }
   return NULL;
 }
 
+static const char* get_scenario_name(void) {
+  static const char* const names[] = {"batch", "producer", "larson"};
+  return names[scenario];
+}
+
+static const char* get_order_name(void) {
+  static const char* const names[] = {"fifo", "lifo", "random"};
+  return names[free_order];
+}
+
+static void print_histogram(const char* name, const Histogram* h, bool json) {
+  const uint64_t p50 = get_percentile(h, 0.5);
+  const uint64_t p99 = get_percentile(h, 0.99);
+  const uint64_t p999 = get_percentile(h, 0.999);
+  if (json) {
+    printf(", \"%s\": {\"count\": %" PRIu64 ", \"p50\": %" PRIu64
+           ", \"p99\": %" PRIu64 ", \"p99.9\": %" PRIu64 ", \"max\": %" PRIu64
+           "}",
+           name, h->count, p50, p99, p999, h->maximum);
+  } else {
+    printf("  %s: %" PRIu64 " ops, p50 %" PRIu64 " ns, p99 %" PRIu64
+           " ns, p99.9 %" PRIu64 " ns, max %" PRIu64 " ns\n",
+           name, h->count, p50, p99, p999, h->maximum);
+  }
+}
+
 static noreturn void help() {
-  fprintf(stderr, HelpMessage, maximum_allocation_size);
+  fprintf(stderr, HelpMessage, maximum_allocation_size,
+          (size_t)larson_slot_count, (size_t)larson_round_count);
   exit(1);
 }
 
 int main(int count, char* arguments[]) {
-  if (count != 4) {
+  if (count < 4 || count > 6) {
     help();
   }
   iterations = strtoul(arguments[1], NULL, 0);
   thread_count = strtoul(arguments[2], NULL, 0);
+  if (iterations == 0 || thread_count == 0) {
+    help();
+  }
+  uint64_t seed = 1;
   if (arguments[3][0] != 'r') {
     allocation_size = strtoul(arguments[3], NULL, 0);
   } else {
     if (strlen(arguments[3]) < 2) {
       help();
     }
-    const unsigned seed = (unsigned)strtoul(&(arguments[3][1]), NULL, 0);
-    srand(seed);
-    printf("random seed: %u\n", seed);
+    seed = strtoull(&(arguments[3][1]), NULL, 0);
     allocation_size = 0;
   }
 
-  arena_create(&a, default_minimum_chunk_units);
+  bool json = false;
+  arena_options.minimum_chunk_units = default_minimum_chunk_units;
+  const char* option_letters = count >= 5 ? arguments[4] : "-";
+  for (const char* o = option_letters; *o != '\0'; o++) {
+    switch (*o) {
+      case '-':
+        break;
+      case 'c':
+        arena_options.thread_cache = true;
+        break;
+      case 't':
+        arena_options.lock_kind = arena_lock_ticket;
+        break;
+      case 's':
+        arena_options.lock_kind = arena_lock_spin;
+        break;
+      case 'r':
+        arena_options.region = true;
+        break;
+      case 'p':
+        per_thread_arenas = true;
+        break;
+      case 'q':
+        arena_options.remote_frees = true;
+        break;
+      case 'u':
+        use_arena_set = true;
+        break;
+      case 'w':
+        reserve = true;
+        break;
+      case 'o':
+        free_order = order_random;
+        break;
+      case 'l':
+        free_order = order_lifo;
+        break;
+      case 'j':
+        json = true;
+        break;
+      default:
+        help();
+    }
+  }
+  if (count == 6) {
+    if (strcmp(arguments[5], "batch") == 0) {
+      scenario = scenario_batch;
+    } else if (strcmp(arguments[5], "producer") == 0) {
+      scenario = scenario_producer;
+    } else if (strcmp(arguments[5], "larson") == 0) {
+      scenario = scenario_larson;
+    } else {
+      help();
+    }
+  }
+  if (!json && allocation_size == 0) {
+    printf("random seed: %" PRIu64 "\n", seed);
+  }
+
+  workers = calloc(thread_count, sizeof(Worker));
+  arenas = calloc(thread_count, sizeof(Arena));
+  rings = aligned_alloc(_Alignof(Ring), thread_count * sizeof(Ring));
+  larson_sets = calloc(thread_count * larson_slot_count, sizeof(Slot));
+  if (workers == NULL || arenas == NULL || rings == NULL ||
+      larson_sets == NULL) {
+    err(errno, "Could not allocate workers\n");
+  }
+  memset(rings, 0, thread_count * sizeof(Ring));
+  if (use_arena_set) {
+    per_thread_arenas = false;
+    if (!arena_set_create(&arena_set, &arena_options)) {
+      err(errno, "Could not create arena set\n");
+    }
+  }
+  if (!per_thread_arenas) {
+    arena_create_with_options(&shared_arena, &arena_options);
+    reserve_memory(&shared_arena, thread_count);
+  }
+  for (size_t i = 0; i < thread_count; i++) {
+    Worker* w = &workers[i];
+    w->index = i;
+    w->random_state = (seed + i) * 0x9e3779b97f4a7c15 | 1;
+    w->arena = per_thread_arenas ? &arenas[i] : &shared_arena;
+  }
 
-  pthread_t* threads = calloc(thread_count, sizeof(pthread_t));
+  // The threads start together, once they have all set up, and we time the
+  // whole run from then. (The barrier includes this thread.)
+  pthread_barrier_init(&barrier, NULL, (unsigned)thread_count + 1);
   for (size_t i = 0; i < thread_count; i++) {
-    int e = pthread_create(&threads[i], NULL, allocate_lots, NULL);
+    int e = pthread_create(&workers[i].thread, NULL, run, &workers[i]);
     if (e) {
       err(errno, "Could not create thread\n");
     }
   }
+  pthread_barrier_wait(&barrier);
+  const int64_t start = GetMonotonicNanoseconds();
+  if (scenario == scenario_larson) {
+    for (size_t r = 0; r < larson_round_count; r++) {
+      pthread_barrier_wait(&barrier);
+    }
+  }
   for (size_t i = 0; i < thread_count; i++) {
-    int e = pthread_join(threads[i], NULL);
+    int e = pthread_join(workers[i].thread, NULL);
     if (e) {
       err(errno, "Could not join thread\n");
     }
   }
+  const int64_t end = GetMonotonicNanoseconds();
 
-  arena_destroy(&a);
+  Histogram mallocs = {0}, frees = {0};
+  for (size_t i = 0; i < thread_count; i++) {
+    merge(&mallocs, &workers[i].mallocs);
+    merge(&frees, &workers[i].frees);
+  }
+  const uint64_t operations = mallocs.count + frees.count;
+  const uint64_t elapsed = end > start ? (uint64_t)(end - start) : 1;
+  const uint64_t ops_per_second =
+      (uint64_t)((double)operations * 1e9 / (double)elapsed);
+  // The memory that the arenas got from the platform for chunks, which they
+  // keep after the regions are freed.
+  size_t chunk_bytes = 0;
+  ArenaStats stats;
+  if (use_arena_set) {
+    arena_set_get_stats(&arena_set, &stats);
+    chunk_bytes += stats.chunk_bytes;
+  }
+  for (size_t i = 0; i < (per_thread_arenas ? thread_count : 1); i++) {
+    arena_get_stats(per_thread_arenas ? &arenas[i] : &shared_arena, &stats);
+    chunk_bytes += stats.chunk_bytes;
+  }
+  if (json) {
+    printf("{\"time\": %" PRId64
+           ", \"scenario\": \"%s\", \"order\": \"%s\", \"options\": \"%s\", "
+           "\"threads\": %zu, \"iterations\": %zu, \"size\": %zu, "
+           "\"seed\": %" PRIu64 ", \"ops_per_second\": %" PRIu64
+           ", \"chunk_bytes\": %zu",
+           GetUTCNanoseconds() / 1000000000, get_scenario_name(),
+           get_order_name(), option_letters, thread_count, iterations,
+           allocation_size, seed, ops_per_second, chunk_bytes);
+    print_histogram("malloc", &mallocs, true);
+    print_histogram("free", &frees, true);
+    printf("}\n");
+  } else {
+    printf("%s%s%s, %zu threads, %s: %" PRIu64 " ops/s, %zu KiB of chunks\n",
+           get_scenario_name(), scenario == scenario_batch ? " " : "",
+           scenario == scenario_batch ? get_order_name() : "", thread_count,
+           use_arena_set       ? "per-CPU arenas"
+           : per_thread_arenas ? "per-thread arenas"
+                               : "shared arena",
+           ops_per_second, chunk_bytes / 1024);
+    print_histogram("malloc", &mallocs, false);
+    print_histogram("free", &frees, false);
+  }
+
+  if (scenario == scenario_larson) {
+    for (size_t i = 0; i < thread_count * larson_slot_count; i++) {
+      release(larson_sets[i].arena, larson_sets[i].p);
+    }
+  }
+  for (size_t i = 0; i < thread_count; i++) {
+    if (per_thread_arenas) {
+      arena_destroy(&arenas[i]);
+    }
+  }
+  if (!per_thread_arenas) {
+    arena_destroy(&shared_arena);
+  }
+  if (use_arena_set) {
+    arena_set_destroy(&arena_set);
+  }
+  pthread_barrier_destroy(&barrier);
+  free(workers);
+  free(arenas);
+  free(rings);
+  free(larson_sets);
 }
@@ -0,0 +1,183 @@
+// Copyright 2022 by [Chris Palmer](https://noncombatant.org)
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "arena_malloc.h"
+#include "get_utc_nanoseconds.h"
+
+static const char HelpMessage[] =
+    "Measures the cost of TLB misses in an arena, with and without\n"
+    "`ArenaOptions.huge_pages`. It allocates `object_count` objects of\n"
+    "`object_size` bytes, links them into 1 cycle in a random order, and\n"
+    "follows the links for `accesses` steps, so that nearly every step\n"
+    "lands on a different page than the last.\n"
+    "\n"
+    "`pages` is \"base\" or \"huge\". Where the platform allows, the test\n"
+    "also counts dTLB load misses (with `perf_event_open`), and reports how\n"
+    "much of the process is backed by transparent huge pages.\n"
+    "\n"
+    "Usage: arena_tlb_test pages object_count object_size accesses seed\n";
+
+static uint64_t random_state;
+
+// xorshift64, so that every platform sees the same cycle for a given seed.
+static uint64_t get_random(void) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return random_state;
+}
+
+// Returns a file descriptor for a counter of the calling thread’s dTLB load
+// misses, or -1 if the platform cannot count them (as in many VMs).
+static int open_dtlb_counter(void) {
+#if defined(__linux__)
+  struct perf_event_attr attribute = {
+      .type = PERF_TYPE_HW_CACHE,
+      .size = sizeof(attribute),
+      .config = PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+      .disabled = 1,
+      .exclude_kernel = 1,
+      .exclude_hv = 1,
+  };
+  return (int)syscall(SYS_perf_event_open, &attribute, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static void start_counter(int counter) {
+#if defined(__linux__)
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#else
+  (void)counter;
+#endif
+}
+
+// Returns the count, or `UINT64_MAX` if there is no counter.
+static uint64_t stop_counter(int counter) {
+#if defined(__linux__)
+  uint64_t value;
+  if (counter >= 0 && ioctl(counter, PERF_EVENT_IOC_DISABLE, 0) == 0 &&
+      read(counter, &value, sizeof(value)) == sizeof(value)) {
+    return value;
+  }
+#else
+  (void)counter;
+#endif
+  return UINT64_MAX;
+}
+
+// Returns how many bytes of the process are backed by transparent huge pages,
+// or `SIZE_MAX` if the platform does not say.
+static size_t get_huge_page_bytes(void) {
+  FILE* f = fopen("/proc/self/smaps_rollup", "r");
+  if (f == NULL) {
+    return SIZE_MAX;
+  }
+  size_t kibibytes = SIZE_MAX;
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "AnonHugePages: %zu kB", &kibibytes) == 1) {
+      break;
+    }
+  }
+  fclose(f);
+  return kibibytes == SIZE_MAX ? SIZE_MAX : kibibytes * 1024;
+}
+
+static noreturn void help() {
+  fprintf(stderr, HelpMessage);
+  exit(1);
+}
+
+int main(int count, char* arguments[]) {
+  if (count != 6) {
+    help();
+  }
+  ArenaOptions options = {0};
+  if (strcmp(arguments[1], "huge") == 0) {
+    options.huge_pages = true;
+  } else if (strcmp(arguments[1], "base") != 0) {
+    help();
+  }
+  const size_t object_count = strtoul(arguments[2], NULL, 0);
+  const size_t object_size = strtoul(arguments[3], NULL, 0);
+  const size_t accesses = strtoul(arguments[4], NULL, 0);
+  random_state = strtoull(arguments[5], NULL, 0) | 1;
+  if (object_count < 2 || object_size < sizeof(void*) || accesses == 0) {
+    help();
+  }
+
+  void** objects = calloc(object_count, sizeof(void*));
+  if (objects == NULL) {
+    printf("%s\n", strerror(errno));
+    return errno;
+  }
+  Arena a;
+  arena_create_with_options(&a, &options);
+  for (size_t i = 0; i < object_count; i++) {
+    objects[i] = arena_calloc(&a, object_size, 1);
+    if (objects[i] == NULL) {
+      printf("%s\n", strerror(errno));
+      return errno;
+    }
+  }
+
+  // Sattolo’s shuffle makes a permutation with a single cycle, so the walk
+  // visits every object before it repeats.
+  for (size_t i = object_count - 1; i > 0; i--) {
+    const size_t j = get_random() % i;
+    void* p = objects[i];
+    objects[i] = objects[j];
+    objects[j] = p;
+  }
+  for (size_t i = 0; i < object_count; i++) {
+    *(void**)objects[i] = objects[(i + 1) % object_count];
+  }
+
+  const int counter = open_dtlb_counter();
+  void* volatile* p = objects[0];
+  start_counter(counter);
+  const int64_t start = GetMonotonicNanoseconds();
+  for (size_t i = 0; i < accesses; i++) {
+    p = *p;
+  }
+  const int64_t end = GetMonotonicNanoseconds();
+  const uint64_t misses = stop_counter(counter);
+
+  printf("%s pages: ns per access: %.1f", arguments[1],
+         (double)(end - start) / (double)accesses);
+  if (misses == UINT64_MAX) {
+    printf(", dTLB misses: unavailable");
+  } else {
+    printf(", dTLB misses per access: %.3f",
+           (double)misses / (double)accesses);
+  }
+  const size_t huge_page_bytes = get_huge_page_bytes();
+  if (huge_page_bytes != SIZE_MAX) {
+    printf(", huge pages: %zu KiB", huge_page_bytes / 1024);
+  }
+  printf("\n");
+
+  arena_destroy(&a);
+  free(objects);
+}
@@ -0,0 +1,80 @@
+// Copyright 2022 by [Chris Palmer](https://noncombatant.org)
+// SPDX-License-Identifier: Apache-2.0
+
+#ifndef ARENA_TRACE_H
+#define ARENA_TRACE_H
+
+#include <assert.h>
+#include <stdint.h>
+
+// A trace of a process’ calls to the `malloc` family, as recorded by
+// libarena_malloc.so (see arena_preload.c) and replayed by arena_replay.c.
+//
+// A trace file is a `TraceHeader` followed by `TraceRecord`s, in the order the
+// calls happened, in the byte order of the machine that recorded it.
+
+// The kinds of call that a `TraceRecord` can describe.
+typedef enum TraceOperation {
+  // `malloc`, with `TraceRecord.object` being the region it returned.
+  trace_malloc,
+
+  // Like `trace_malloc`, but the region must be zeroed.
+  trace_calloc,
+
+  // Like `trace_malloc`, but the region must be aligned to
+  // `1 << TraceRecord.alignment_shift` bytes. (`posix_memalign`,
+  // `aligned_alloc`, `memalign`, `valloc`, and `pvalloc` all record this.)
+  trace_aligned_malloc,
+
+  // `free`, with `TraceRecord.object` being the region freed.
+  trace_free,
+
+  // The start of a call to `realloc`, with `TraceRecord.object` being the old
+  // region (or 0) and `TraceRecord.size` the new size. Some later record from
+  // the same thread is always the matching `trace_realloc_result`; other
+  // threads’ records may come in between.
+  trace_realloc,
+
+  // The end of a call to `realloc`, with `TraceRecord.object` being the region
+  // it returned, or 0 if it failed (in which case the old region is still
+  // live).
+  trace_realloc_result,
+} TraceOperation;
+
+// Objects are identified by their addresses, which are unique among live
+// objects. (An address reappears once its object has been freed; replayers
+// must tell the objects apart by the order of the records.)
+typedef struct TraceRecord {
+  // Nanoseconds since the process started tracing.
+  uint64_t nanoseconds;
+
+  uint64_t object;
+
+  // The number of bytes requested. (For `calloc`, `count * size`.)
+  uint64_t size;
+
+  // Small integers, assigned in the order that threads first called in.
+  uint32_t thread;
+
+  // A `TraceOperation`.
+  uint8_t operation;
+
+  uint8_t alignment_shift;
+  uint16_t reserved;
+} TraceRecord;
+
+static_assert(sizeof(TraceRecord) == 32, "Adjust `TraceRecord` padding");
+
+#define TRACE_MAGIC "ArenaTrc"
+#define TRACE_VERSION 1
+
+typedef struct TraceHeader {
+  char magic[8];
+  uint32_t version;
+
+  // `sizeof(TraceRecord)`, so that readers can reject traces from builds
+  // that disagree about the layout.
+  uint32_t record_size;
+} TraceHeader;
+
+#endif
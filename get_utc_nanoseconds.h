@@ -10,4 +10,10 @@
 
 int64_t GetUTCNanoseconds(void);
 
+// Returns the time since some fixed point in the past, in nanoseconds, or 0 on
+// error. Unlike the UTC time, it never jumps, so it is the one to use for
+// measuring intervals.
+
+int64_t GetMonotonicNanoseconds(void);
+
 #endif
@@ -10,3 +10,11 @@ int64_t GetUTCNanoseconds(void) {
   }
   return (time.tv_sec * 1000000000LL) + time.tv_nsec;
 }
+
+int64_t GetMonotonicNanoseconds(void) {
+  struct timespec time;
+  if (clock_gettime(CLOCK_MONOTONIC, &time)) {
+    return 0;
+  }
+  return (time.tv_sec * 1000000000LL) + time.tv_nsec;
+}